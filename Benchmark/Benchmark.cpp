@@ -0,0 +1,548 @@
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "MappedFile.hpp"
+#include "ParallelScan.hpp"
+
+#include "Arena.hpp"
+#include "Efi.hpp"
+#include "ExportTable.hpp"
+#include "Memory.hpp"
+#include "PatchBootmgfw.hpp"
+#include "PatchCache.hpp"
+#include "PatchNtoskrnl.hpp"
+#include "XrefIndex.hpp"
+
+struct Measurement
+{
+    uint64_t Cycles;
+    double Microseconds;
+};
+
+static size_t Iterations = 10;
+static size_t ScanThreads = 1;
+
+// Best of all iterations, Prepare runs before every iteration and is not measured
+template<typename Prepare, typename Body>
+static Measurement Measure(Prepare&& PrepareIteration, Body&& RunIteration)
+{
+    Measurement Best = { UINT64_MAX, 0 };
+
+    for (size_t i = 0; i < Iterations; i++)
+    {
+        PrepareIteration();
+
+        auto StartTime = std::chrono::steady_clock::now();
+        auto StartCycles = __rdtsc();
+        RunIteration();
+        auto Cycles = __rdtsc() - StartCycles;
+        auto EndTime = std::chrono::steady_clock::now();
+
+        if (Cycles < Best.Cycles)
+        {
+            Best.Cycles = Cycles;
+            Best.Microseconds = std::chrono::duration<double, std::micro>(EndTime - StartTime).count();
+        }
+    }
+
+    return Best;
+}
+
+template<typename Body>
+static Measurement Measure(Body&& RunIteration)
+{
+    return Measure([] {}, RunIteration);
+}
+
+static void PrintMeasurement(const char* Name, const char* Detail, size_t Bytes, const Measurement& Result)
+{
+    printf("  %-36s %-10s %12" PRIu64 " cycles %8.2f bytes/cycle %10.1f us\n",
+        Name,
+        Detail,
+        Result.Cycles,
+        (double)Bytes / (double)std::max<uint64_t>(Result.Cycles, 1),
+        Result.Microseconds);
+}
+
+// Lays out a PE file like the loader would (no relocations, the patch routines only use RVAs)
+static bool LoadImage(const MappedFile& File, std::vector<uint8_t>& Image)
+{
+    auto SizeOfImage = GetImageFileSize(File.Data(), File.Size());
+    if (SizeOfImage == 0)
+    {
+        return false;
+    }
+
+    Image.resize(SizeOfImage);
+
+    return MapImageFile(File.Data(), File.Size(), Image.data(), Image.size());
+}
+
+// Runs the signature of every patch on its own and reports whether all of them were found
+static bool BenchmarkSignatures(uint8_t* ImageBase, size_t ImageSize, const PatchEntry* Entries, size_t Count)
+{
+    auto AllFound = true;
+
+    for (size_t i = 0; i < Count; i++)
+    {
+        auto& Entry = Entries[i];
+        auto Base = ImageBase;
+        auto Size = ImageSize;
+
+        if (Entry.SectionName != nullptr)
+        {
+            auto Section = FindSection(ImageBase, Entry.SectionName);
+            if (Section == nullptr)
+            {
+                printf("  %-36s missing section %s\n", Entry.Name, Entry.SectionName);
+                AllFound = false;
+                continue;
+            }
+
+            Base = RVA<uint8_t*>(ImageBase, Section->VirtualAddress);
+            Size = Section->Misc.VirtualSize;
+        }
+
+        auto Scan = SignatureScan(Entry.Pattern);
+        Measurement Result = {};
+        size_t ScannedBytes = 0;
+        if (Entry.SectionName != nullptr)
+        {
+            Result = Measure([&] { FindPattern(Base, Size, Scan); });
+
+            // The scan stops at the first match, so only count the bytes up to it
+            ScannedBytes = Scan.Match != nullptr ? size_t(Scan.Match - Base) + Scan.PatternLen : Size;
+        }
+        else
+        {
+            // Like FindPatchSites, every executable section is swept to the end
+            Result = Measure([&] { ScannedBytes = FindPatternsInSections(ImageBase, ImageSize, SectionExecutable, &Scan, 1); });
+        }
+
+        auto Match = Scan.Match;
+
+        char Detail[32];
+        if (Match != nullptr)
+        {
+            snprintf(Detail, sizeof(Detail), "+%" PRIx64, (uint64_t)(Match - ImageBase));
+        }
+        else
+        {
+            snprintf(Detail, sizeof(Detail), "not found");
+            AllFound = false;
+        }
+
+        PrintMeasurement(Entry.Name, Detail, ScannedBytes, Result);
+    }
+
+    return AllFound;
+}
+
+// The same batches as FindPatchSites (one sweep per section)
+static size_t BenchmarkSectionBatches(uint8_t* ImageBase, const PatchEntry* Entries, size_t Count)
+{
+    size_t ScannedBytes = 0;
+
+    for (size_t i = 0; i < Count; i++)
+    {
+        auto SectionName = Entries[i].SectionName;
+        if (SectionName == nullptr)
+        {
+            continue;
+        }
+
+        // Only the first entry of every section starts a batch
+        auto FirstInSection = true;
+        for (size_t j = 0; j < i; j++)
+        {
+            if (Entries[j].SectionName != nullptr && strcmp(Entries[j].SectionName, SectionName) == 0)
+            {
+                FirstInSection = false;
+                break;
+            }
+        }
+
+        auto Section = FindSection(ImageBase, SectionName);
+        if (!FirstInSection || Section == nullptr)
+        {
+            continue;
+        }
+
+        PatternScan Scans[MaxPatternScans];
+        size_t ScanCount = 0;
+        for (size_t j = i; j < Count && ScanCount < MaxPatternScans; j++)
+        {
+            if (Entries[j].SectionName != nullptr && strcmp(Entries[j].SectionName, SectionName) == 0)
+            {
+                Scans[ScanCount++] = SignatureScan(Entries[j].Pattern);
+            }
+        }
+
+        auto Base = RVA<uint8_t*>(ImageBase, Section->VirtualAddress);
+        auto Size = Section->Misc.VirtualSize;
+        auto Result = Measure([&] { FindPatterns(Base, Size, Scans, ScanCount); });
+
+        auto Name = std::string("FindPatterns ") + SectionName;
+        char Detail[32];
+        snprintf(Detail, sizeof(Detail), "%zu sigs", ScanCount);
+        PrintMeasurement(Name.c_str(), Detail, Size, Result);
+
+        // The same batch split across threads
+        if (ScanThreads > 1)
+        {
+            Result = Measure([&] { ParallelFindPatterns(Base, Size, Scans, ScanCount, ScanThreads); });
+
+            Name = std::string("ParallelFindPatterns ") + SectionName;
+            snprintf(Detail, sizeof(Detail), "%zu threads", ScanThreads);
+            PrintMeasurement(Name.c_str(), Detail, Size, Result);
+        }
+
+        ScannedBytes += Size;
+    }
+
+    return ScannedBytes;
+}
+
+// Every named export of the image, looked up in the name table (GetExport) and in the hash table
+static void BenchmarkExports(uint8_t* ImageBase, size_t ImageSize)
+{
+    PeImage Image(ImageBase, ImageSize);
+    if (Image.ExportDirectory == nullptr)
+    {
+        return;
+    }
+
+    // Room for the largest table the names can need
+    Arena Region = {};
+    ExportTable Table = {};
+    auto ArenaSize = std::max<size_t>(MinExportSlots, (size_t)Image.ExportDirectory->NumberOfNames * 4) * sizeof(ExportSlot);
+    if (!InitializeArena(Region, ArenaSize) || !BuildExportTable(Table, Image, Region))
+    {
+        ReleaseArena(Region);
+        return;
+    }
+
+    // The allocation is part of the build, the table of the previous iteration is freed first
+    auto Result = Measure([&] { ArenaReset(Region); }, [&] { BuildExportTable(Table, Image, Region); });
+
+    char Detail[32];
+    snprintf(Detail, sizeof(Detail), "%zu names", Table.Count);
+    PrintMeasurement("BuildExportTable", Detail, Table.SlotCount * sizeof(ExportSlot), Result);
+
+    std::vector<const char*> Names;
+    size_t NameBytes = 0;
+    auto ExportNames = RVA<uint32_t*>(ImageBase, Image.ExportDirectory->AddressOfNames);
+    for (uint32_t i = 0; i < Image.ExportDirectory->NumberOfNames; i++)
+    {
+        Names.push_back(RVA<const char*>(ImageBase, ExportNames[i]));
+        NameBytes += strlen(Names.back());
+    }
+
+    size_t Mismatches = 0;
+    for (auto Name : Names)
+    {
+        Mismatches += FindExport(Table, Name) != GetExport(ImageBase, Name);
+    }
+
+    // Both lookups add up the addresses they return, printed below so the calls are not optimized away
+    uintptr_t GetExportSum = 0;
+    Result = Measure([&]
+        {
+            for (auto Name : Names)
+            {
+                GetExportSum += (uintptr_t)GetExport(ImageBase, Name);
+            }
+        });
+    PrintMeasurement("GetExport", "all names", NameBytes, Result);
+
+    uintptr_t FindExportSum = 0;
+    Result = Measure([&]
+        {
+            for (auto Name : Names)
+            {
+                FindExportSum += (uintptr_t)FindExport(Table, Name);
+            }
+        });
+    PrintMeasurement("FindExport", "all names", NameBytes, Result);
+
+    if (Mismatches != 0)
+    {
+        printf("  FindExport differs from GetExport for %zu names\n", Mismatches);
+    }
+
+    printf("  %-36s %-10s %16" PRIxPTR " %16" PRIxPTR "\n", "Export address sums", "", GetExportSum, FindExportSum);
+
+    printf("  %-36s %-10s %12zu bytes peak, %zu bytes in %zu allocations\n", "Arena", "", Region.Peak, Region.Total, Region.Allocations);
+    ReleaseArena(Region);
+}
+
+static void BenchmarkNtoskrnl(const MappedFile& File, const std::vector<uint8_t>& Pristine)
+{
+    auto Image = Pristine;
+    auto ImageBase = Image.data();
+    auto ImageSize = Image.size();
+
+    BenchmarkSignatures(ImageBase, ImageSize, NtoskrnlPatches, NtoskrnlPatchCount);
+    auto ScannedBytes = BenchmarkSectionBatches(ImageBase, NtoskrnlPatches, NtoskrnlPatchCount);
+
+    auto TextSection = FindSection(ImageBase, ".text");
+    if (TextSection == nullptr)
+    {
+        return;
+    }
+
+    auto TextBase = RVA<uint8_t*>(ImageBase, TextSection->VirtualAddress);
+    auto TextSize = TextSection->Misc.VirtualSize;
+
+    static std::vector<uint8_t> XrefStorage(XrefStorageSize);
+    XrefIndex TextXrefs = {};
+    auto XrefsBuilt = false;
+    auto Result = Measure([&] { XrefsBuilt = BuildXrefIndex(TextXrefs, ImageBase, TextBase, TextSize, XrefStorage.data(), XrefStorage.size()); });
+
+    char Detail[32];
+    snprintf(Detail, sizeof(Detail), "%zu xrefs", XrefsBuilt ? TextXrefs.Count : 0);
+    PrintMeasurement("BuildXrefIndex .text", Detail, TextSize, Result);
+
+    // PatchNtoskrnl dies on a mismatch, only run it when it will succeed
+    uint8_t* Sites[MaxPatchSites] = {};
+    if (!FindPatchSites(PeImage(ImageBase, ImageSize), NtoskrnlPatches, NtoskrnlPatchCount, Sites))
+    {
+        puts("  PatchNtoskrnl                        skipped (unsupported kernel)");
+        return;
+    }
+
+    // Every iteration has to start from an unpatched image
+    Result = Measure(
+        [&] { memcpy(Image.data(), Pristine.data(), Pristine.size()); },
+        [&] { PatchNtoskrnl(ImageBase, ImageSize); });
+
+    PrintMeasurement("PatchNtoskrnl", "end-to-end", ScannedBytes, Result);
+
+    // Again with the sites resolved offline, like the Injector does when it is given ntoskrnl.exe
+    PatchCache Cache = {};
+    Cache.Magic = PatchCacheMagic;
+    Cache.Version = PatchCacheVersion;
+    if (!ResolvePatchCacheEntry(PatchCacheNtoskrnl, File.Data(), File.Size(), Cache.Entries[PatchCacheNtoskrnl]))
+    {
+        return;
+    }
+
+    SetPatchCache(&Cache);
+    Result = Measure(
+        [&] { memcpy(Image.data(), Pristine.data(), Pristine.size()); },
+        [&] { PatchNtoskrnl(ImageBase, ImageSize); });
+    SetPatchCache(nullptr);
+
+    PrintMeasurement("PatchNtoskrnl", "cached", ScannedBytes, Result);
+}
+
+static void BenchmarkBootmgfw(const std::vector<uint8_t>& Pristine)
+{
+    auto Image = Pristine;
+    BenchmarkSignatures(Image.data(), Image.size(), BootmgfwPatches, BootmgfwPatchCount);
+}
+
+static void BenchmarkFile(const std::filesystem::path& Path)
+{
+    auto FileName = Path.filename().string();
+    std::transform(FileName.begin(), FileName.end(), FileName.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+
+    auto IsNtoskrnl = FileName.find("ntoskrnl") != std::string::npos;
+    auto IsBootmgfw = FileName.find("bootmgfw") != std::string::npos;
+    if (!IsNtoskrnl && !IsBootmgfw)
+    {
+        return;
+    }
+
+    MappedFile File;
+    std::vector<uint8_t> Image;
+    if (!File.Open(Path) || !LoadImage(File, Image))
+    {
+        printf("%s: not a valid x64 PE file\n", Path.string().c_str());
+        return;
+    }
+
+    printf("%s (%zu bytes, image %zu bytes)\n", Path.string().c_str(), File.Size(), Image.size());
+    BenchmarkExports(Image.data(), Image.size());
+
+    if (IsNtoskrnl)
+    {
+        BenchmarkNtoskrnl(File, Image);
+    }
+    else
+    {
+        BenchmarkBootmgfw(Image);
+    }
+}
+
+// The implementations Memory.cpp replaced: a byte loop, rep movsb and rep stosb
+__declspec(noinline) static int BaselineCompare(const void* Left, const void* Right, size_t Size)
+{
+    int32_t Value = 0;
+    auto Ptr1 = (const uint8_t*)Left;
+    auto Ptr2 = (const uint8_t*)Right;
+
+    while (Size-- > 0 && Value == 0)
+    {
+        Value = *(Ptr1++) - *(Ptr2++);
+    }
+
+    return Value;
+}
+
+__declspec(noinline) static void* BaselineCopy(void* Target, const void* Source, size_t Size)
+{
+    __movsb((uint8_t*)Target, (const uint8_t*)Source, Size);
+
+    return Target;
+}
+
+__declspec(noinline) static void* BaselineSet(void* Target, uint8_t Value, size_t Size)
+{
+    __stosb((uint8_t*)Target, Value, Size);
+
+    return Target;
+}
+
+template<typename Body>
+static Measurement MeasureCalls(size_t Calls, Body&& Call)
+{
+    auto Result = Measure([&]
+        {
+            for (size_t i = 0; i < Calls; i++)
+            {
+                Call();
+            }
+        });
+
+    Result.Cycles /= Calls;
+    Result.Microseconds /= (double)Calls;
+
+    return Result;
+}
+
+// From patch writes (3 bytes) up to whole images (EfiRelocateImage, IsNtoskrnl)
+static void BenchmarkMemory()
+{
+    static const size_t Sizes[] = { 3, 8, 15, 32, 64, 100, 256, 1024, 4096, 65536, 1 << 20, 16 << 20 };
+
+    static std::vector<uint8_t> Source((16 << 20) + 64, 0x5A);
+    static std::vector<uint8_t> Target(Source.size(), 0x5A);
+    static volatile int Sink = 0;
+
+    // Called through volatile pointers so the calls are not hoisted out of the loops
+    static decltype(&MemoryCopy) volatile CopyFunction = nullptr;
+    static decltype(&MemorySet) volatile SetFunction = nullptr;
+    static decltype(&MemoryCompare) volatile CompareFunction = nullptr;
+
+    struct Variant
+    {
+        const char* Name;
+        decltype(&MemoryCopy) Copy;
+        decltype(&MemorySet) Set;
+        decltype(&MemoryCompare) Compare;
+    };
+
+    static const Variant Variants[] = {
+        { "baseline", BaselineCopy, BaselineSet, BaselineCompare },
+        { "Memory.cpp", MemoryCopy, MemorySet, MemoryCompare },
+    };
+
+    puts("Memory routines (per call, equal buffers for memcmp)");
+
+    for (auto Size : Sizes)
+    {
+        // Enough calls per iteration to be well above the TSC overhead
+        auto Calls = std::min<size_t>(std::max<size_t>((256 * 1024) / Size, 1), 4096);
+
+        char Detail[32];
+        snprintf(Detail, sizeof(Detail), "%zu", Size);
+
+        for (auto& Variant : Variants)
+        {
+            CopyFunction = Variant.Copy;
+            SetFunction = Variant.Set;
+            CompareFunction = Variant.Compare;
+
+            auto Name = std::string("memcpy ") + Variant.Name;
+            auto Result = MeasureCalls(Calls, [&] { CopyFunction(Target.data() + 1, Source.data() + 3, Size); });
+            PrintMeasurement(Name.c_str(), Detail, Size, Result);
+
+            Name = std::string("memset ") + Variant.Name;
+            Result = MeasureCalls(Calls, [&] { SetFunction(Target.data() + 1, 0x5A, Size); });
+            PrintMeasurement(Name.c_str(), Detail, Size, Result);
+
+            Name = std::string("memcmp ") + Variant.Name;
+            Result = MeasureCalls(Calls, [&] { Sink = Sink + CompareFunction(Target.data() + 1, Source.data() + 3, Size); });
+            PrintMeasurement(Name.c_str(), Detail, Size, Result);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        puts("Usage: Benchmark <directory or file> [iterations] [threads]");
+        puts("       Benchmark --memory [iterations]");
+        puts("Benchmarks every file with ntoskrnl or bootmgfw in its name, or the memcpy/memset/memcmp routines");
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 2)
+    {
+        Iterations = std::max(strtoull(argv[2], nullptr, 0), 1ull);
+    }
+
+    if (strcmp(argv[1], "--memory") == 0)
+    {
+        BenchmarkMemory();
+        return EXIT_SUCCESS;
+    }
+
+    // Section scans are also measured split across this many threads
+    if (argc > 3)
+    {
+        ScanThreads = std::max(strtoull(argv[3], nullptr, 0), 1ull);
+    }
+
+    if (!InitializePatchEngine())
+    {
+        puts("Failed to initialize the patch engine");
+        return EXIT_FAILURE;
+    }
+
+    std::error_code Error;
+    std::filesystem::path Path = argv[1];
+    if (std::filesystem::is_directory(Path, Error))
+    {
+        std::vector<std::filesystem::path> Files;
+        for (auto& Entry : std::filesystem::directory_iterator(Path, Error))
+        {
+            if (Entry.is_regular_file(Error))
+            {
+                Files.push_back(Entry.path());
+            }
+        }
+
+        std::sort(Files.begin(), Files.end());
+        for (auto& File : Files)
+        {
+            BenchmarkFile(File);
+        }
+    }
+    else
+    {
+        BenchmarkFile(Path);
+    }
+
+    ShutdownPatchEngine();
+
+    return EXIT_SUCCESS;
+}
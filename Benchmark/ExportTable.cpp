@@ -0,0 +1,102 @@
+#include "ExportTable.hpp"
+
+static ExportSlot* FindExportSlot(const ExportTable& Table, uint64_t NameHash, const char* FunctionName)
+{
+    for (size_t i = 0; i < Table.SlotCount; i++)
+    {
+        auto& Slot = Table.Slots[(NameHash + i) & (Table.SlotCount - 1)];
+        if (Slot.NameRva == 0)
+        {
+            break;
+        }
+
+        // Fnv1a ignores the case, export names do not
+        if (Slot.NameHash == NameHash && strcmp(RVA<char*>(Table.ImageBase, Slot.NameRva), FunctionName) == 0)
+        {
+            return &Slot;
+        }
+    }
+
+    return nullptr;
+}
+
+bool BuildExportTable(ExportTable& Table, const PeImage& Image, Arena& Region, uint64_t ModuleHash)
+{
+    Table = {};
+
+    // The name and the tables are only read when they fit into the image
+    auto ExportDir = Image.ExportDirectory;
+    if (ExportDir == nullptr || ExportDir->NumberOfNames == 0 || !Image.Contains(ExportDir->Name, 1) ||
+        !Image.Contains(ExportDir->AddressOfNames, (uint64_t)ExportDir->NumberOfNames * sizeof(uint32_t)) ||
+        !Image.Contains(ExportDir->AddressOfNameOrdinals, (uint64_t)ExportDir->NumberOfNames * sizeof(uint16_t)) ||
+        !Image.Contains(ExportDir->AddressOfFunctions, (uint64_t)ExportDir->NumberOfFunctions * sizeof(uint32_t)))
+    {
+        return false;
+    }
+
+    if (ModuleHash != 0 && Fnv1a(RVA<char*>(Image.Base, ExportDir->Name)) != ModuleHash)
+    {
+        return false;
+    }
+
+    auto SlotCount = MinExportSlots;
+    while (SlotCount < (size_t)ExportDir->NumberOfNames * 2)
+    {
+        SlotCount *= 2;
+    }
+
+    auto Slots = (ExportSlot*)ArenaAllocate(Region, SlotCount * sizeof(ExportSlot));
+    if (Slots == nullptr)
+    {
+        return false;
+    }
+
+    Table.ImageBase = Image.Base;
+    Table.Slots = Slots;
+    Table.SlotCount = SlotCount;
+    memset(Table.Slots, 0, SlotCount * sizeof(ExportSlot));
+
+    auto ExportNames = RVA<uint32_t*>(Image.Base, ExportDir->AddressOfNames);
+    auto ExportOrds = RVA<uint16_t*>(Image.Base, ExportDir->AddressOfNameOrdinals);
+    auto ExportFuncs = RVA<uint32_t*>(Image.Base, ExportDir->AddressOfFunctions);
+
+    for (uint32_t i = 0; i < ExportDir->NumberOfNames; i++)
+    {
+        auto NameRva = ExportNames[i];
+        if (NameRva == 0 || !Image.Contains(NameRva, 1) || ExportOrds[i] >= ExportDir->NumberOfFunctions)
+        {
+            continue;
+        }
+
+        // The table is at most half full, there always is a free slot
+        auto NameHash = Fnv1a(RVA<char*>(Image.Base, NameRva));
+        auto Index = NameHash & (SlotCount - 1);
+        while (Table.Slots[Index].NameRva != 0)
+        {
+            Index = (Index + 1) & (SlotCount - 1);
+        }
+
+        Table.Slots[Index].NameHash = NameHash;
+        Table.Slots[Index].NameRva = NameRva;
+        Table.Slots[Index].FunctionRva = ExportFuncs[ExportOrds[i]];
+        Table.Count++;
+    }
+
+    return true;
+}
+
+void* FindExport(const ExportTable& Table, const char* FunctionName)
+{
+    if (Table.Slots == nullptr)
+    {
+        return nullptr;
+    }
+
+    auto Slot = FindExportSlot(Table, Fnv1a(FunctionName), FunctionName);
+    if (Slot == nullptr)
+    {
+        return nullptr;
+    }
+
+    return RVA<void*>(Table.ImageBase, Slot->FunctionRva);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Arena.hpp"
+#include "Efi.hpp"
+
+// Smallest table, it is grown to a power of two with at least twice as many slots as names
+static const size_t MinExportSlots = 16;
+
+struct ExportSlot
+{
+    uint64_t NameHash;    // Fnv1a of the name
+    uint32_t NameRva;     // Zero for empty slots
+    uint32_t FunctionRva;
+};
+
+// Host-side open addressing table of every named export of an image, lookups hash the name once instead of searching the name table.
+// The bootkit resolves a single export per module, so it keeps the binary search of GetExport.
+struct ExportTable
+{
+    uint8_t* ImageBase;
+    ExportSlot* Slots;
+    size_t SlotCount;
+    size_t Count;
+};
+
+// Allocates the slots from the arena (freed with it), fails without exports, for other modules than ModuleHash or without memory
+bool BuildExportTable(ExportTable& Table, const PeImage& Image, Arena& Region, uint64_t ModuleHash = 0);
+
+// Null if the name is not exported (names are compared exactly, unlike GetExport), forwarders resolve to their string
+void* FindExport(const ExportTable& Table, const char* FunctionName);
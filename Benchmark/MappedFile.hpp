@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const std::filesystem::path& Path)
+    {
+        Close();
+
+#ifdef _WIN32
+        auto hFile = CreateFileW(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER FileSize = {};
+        if (GetFileSizeEx(hFile, &FileSize) && FileSize.QuadPart > 0)
+        {
+            auto hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (hMapping != nullptr)
+            {
+                m_Data = (uint8_t*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+                m_Size = m_Data != nullptr ? (size_t)FileSize.QuadPart : 0;
+                CloseHandle(hMapping);
+            }
+        }
+        CloseHandle(hFile);
+#else
+        auto Fd = open(Path.c_str(), O_RDONLY);
+        if (Fd == -1)
+        {
+            return false;
+        }
+
+        struct stat Stat = {};
+        if (fstat(Fd, &Stat) == 0 && Stat.st_size > 0)
+        {
+            auto Data = mmap(nullptr, (size_t)Stat.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+            if (Data != MAP_FAILED)
+            {
+                m_Data = (uint8_t*)Data;
+                m_Size = (size_t)Stat.st_size;
+            }
+        }
+        close(Fd);
+#endif
+
+        return m_Data != nullptr;
+    }
+
+    void Close()
+    {
+        if (m_Data == nullptr)
+        {
+            return;
+        }
+
+#ifdef _WIN32
+        UnmapViewOfFile(m_Data);
+#else
+        munmap(m_Data, m_Size);
+#endif
+
+        m_Data = nullptr;
+        m_Size = 0;
+    }
+
+    const uint8_t* Data() const
+    {
+        return m_Data;
+    }
+
+    size_t Size() const
+    {
+        return m_Size;
+    }
+
+private:
+    uint8_t* m_Data = nullptr;
+    size_t m_Size = 0;
+};
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "ParallelScan.hpp"
+
+struct ChunkResult
+{
+    uint8_t* Match;
+    size_t MatchCount;
+};
+
+struct ParallelScanJob
+{
+    uint8_t* Base;
+    size_t Size;
+    size_t ChunkSize;
+    size_t ChunkCount;
+    size_t Overlap; // Longest pattern - 1, the bytes a chunk reads past its end
+    const PatternScan* Scans;
+    size_t ScanCount;
+    std::atomic<size_t> NextChunk;
+    ChunkResult Results[MaxScanChunks][MaxPatternScans];
+};
+
+static void ScanChunk(ParallelScanJob& Job, size_t Chunk)
+{
+    auto Start = Chunk * Job.ChunkSize;
+    auto ChunkSize = std::min(Job.ChunkSize, Job.Size - Start);
+    auto ScanSize = std::min(ChunkSize + Job.Overlap, Job.Size - Start);
+    auto Base = Job.Base + Start;
+
+    PatternScan Scans[MaxPatternScans];
+    memcpy(Scans, Job.Scans, Job.ScanCount * sizeof(PatternScan));
+    FindPatterns(Base, ScanSize, Scans, Job.ScanCount);
+
+    for (size_t i = 0; i < Job.ScanCount; i++)
+    {
+        auto& Scan = Scans[i];
+        auto& Result = Job.Results[Chunk][i];
+
+        // Matches that start in the overlap belong to the next chunk, patterns shorter than the longest reach into it
+        for (auto Offset = ChunkSize; Scan.MatchCount != 0 && Offset + Scan.PatternLen <= ScanSize; Offset++)
+        {
+            if (ComparePattern(Base + Offset, Scan))
+            {
+                Scan.MatchCount--;
+            }
+        }
+
+        Result.Match = Scan.MatchCount != 0 ? Scan.Match : nullptr;
+        Result.MatchCount = Scan.MatchCount;
+    }
+}
+
+static void ScanChunks(ParallelScanJob& Job)
+{
+    // Chunks are handed out in order, a thread that was descheduled only delays its current one
+    for (auto Chunk = Job.NextChunk++; Chunk < Job.ChunkCount; Chunk = Job.NextChunk++)
+    {
+        ScanChunk(Job, Chunk);
+    }
+}
+
+void ParallelFindPatterns(uint8_t* Base, size_t Size, PatternScan* Scans, size_t ScanCount, size_t ThreadCount)
+{
+    auto ChunkCount = std::min({ ThreadCount * 2, MaxScanChunks, Size / MinScanChunkSize });
+    if (ThreadCount < 2 || ChunkCount < 2 || ScanCount == 0 || ScanCount > MaxPatternScans)
+    {
+        FindPatterns(Base, Size, Scans, ScanCount);
+        return;
+    }
+
+    ParallelScanJob Job;
+    Job.Base = Base;
+    Job.Size = Size;
+    Job.ChunkSize = (Size + ChunkCount - 1) / ChunkCount;
+    Job.ChunkCount = ChunkCount;
+    Job.Scans = Scans;
+    Job.ScanCount = ScanCount;
+    Job.NextChunk = 0;
+
+    size_t MaxPatternLen = 0;
+    for (size_t i = 0; i < ScanCount; i++)
+    {
+        MaxPatternLen = std::max(MaxPatternLen, Scans[i].PatternLen);
+    }
+    Job.Overlap = MaxPatternLen != 0 ? MaxPatternLen - 1 : 0;
+
+    // The calling thread takes chunks as well
+    std::vector<std::thread> Threads;
+    for (size_t i = 1; i < ThreadCount; i++)
+    {
+        Threads.emplace_back(ScanChunks, std::ref(Job));
+    }
+    ScanChunks(Job);
+    for (auto& Thread : Threads)
+    {
+        Thread.join();
+    }
+
+    // Merged in address order, so the result does not depend on which thread scanned what
+    for (size_t i = 0; i < ScanCount; i++)
+    {
+        Scans[i].Match = nullptr;
+        Scans[i].MatchCount = 0;
+
+        for (size_t Chunk = 0; Chunk < ChunkCount; Chunk++)
+        {
+            auto& Result = Job.Results[Chunk][i];
+            if (Scans[i].Match == nullptr)
+            {
+                Scans[i].Match = Result.Match;
+            }
+            Scans[i].MatchCount += Result.MatchCount;
+        }
+    }
+}
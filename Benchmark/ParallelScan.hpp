@@ -0,0 +1,11 @@
+#pragma once
+
+#include "Efi.hpp"
+
+// Host-side split of a sweep into chunks that are scanned on separate threads. The bootkit itself only scans
+// ntoskrnl from the winload callback, where the application processors cannot be started, so it keeps the single sweep.
+static const size_t MaxScanChunks = 16;
+static const size_t MinScanChunkSize = 256 * 1024; // Smaller ranges are not worth starting threads for
+
+// Same results as FindPatterns, falls back to it for a single thread or a small range
+void ParallelFindPatterns(uint8_t* Base, size_t Size, PatternScan* Scans, size_t ScanCount, size_t ThreadCount);
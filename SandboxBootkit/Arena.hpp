@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Efi.hpp"
+
+// Allocations are aligned to this by default (like the pool)
+static const size_t ArenaAlignment = 16;
+
+// Transient allocations of the boot services phase: device paths, handle buffers and lookup tables
+static const size_t TransientArenaSize = 256 * 1024;
+
+// Bump allocator over pages reserved once, memory is only given back all at once or by an ArenaScope
+struct Arena
+{
+    uint8_t* Base;
+    size_t Size;
+    size_t Used;
+    size_t Peak;        // Highest Used, including the alignment padding
+    size_t Total;       // Bytes handed out since the arena was initialized
+    size_t Allocations;
+};
+
+// Everything allocated from the arena while the scope is alive is freed when it ends
+struct ArenaScope
+{
+    Arena& Region;
+    size_t Mark;
+
+    explicit ArenaScope(Arena& Target)
+        : Region(Target), Mark(Target.Used)
+    {
+    }
+
+    ~ArenaScope()
+    {
+        Region.Used = Mark;
+    }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+// Reset once ntoskrnl is patched, the pages are boot services data the OS reclaims after ExitBootServices
+extern Arena gTransientArena;
+
+// Reserves the pages as boot services data, does nothing if the arena already has them
+bool InitializeArena(Arena& Region, size_t Size);
+
+// Null if the arena is full or the alignment is not a power of two, the memory is not cleared
+void* ArenaAllocate(Arena& Region, size_t Size, size_t Alignment = ArenaAlignment);
+
+// Frees every allocation but keeps the pages, usable without boot services
+void ArenaReset(Arena& Region);
+
+// Gives the pages back to the firmware, boot services have to be available
+void ReleaseArena(Arena& Region);
@@ -1,4 +1,9 @@
+#include <algorithm>
+
 #include "Efi.hpp"
+#include "Arena.hpp"
+#include "Memory.hpp"
+#include "Trace.hpp"
 
 EFI_HANDLE gImageHandle;
 EFI_SYSTEM_TABLE* gST;
@@ -7,7 +12,6 @@ EFI_BOOT_SERVICES* gBS;
 EFI_GUID gEfiSimpleFileSystemProtocolGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
 EFI_GUID gEfiLoadedImageProtocolGuid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
 EFI_GUID gEfiDevicePathProtocolGuid = EFI_DEVICE_PATH_PROTOCOL_GUID;
-EFI_GUID gEfiDevicePathUtilitiesProtocolGuid = EFI_DEVICE_PATH_UTILITIES_PROTOCOL_GUID;
 
 void EfiInitializeGlobals(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
 {
@@ -16,40 +20,56 @@ void EfiInitializeGlobals(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable)
     gBS = SystemTable->BootServices;
 }
 
-EFI_STATUS EfiFileDevicePath(EFI_HANDLE Device, const wchar_t* FileName, EFI_DEVICE_PATH** NewDevicePath)
+// Size of a device path without its end node
+static size_t EfiDevicePathSize(EFI_DEVICE_PATH* DevicePath)
 {
-    // Get the device path utils
-    EFI_DEVICE_PATH_UTILITIES_PROTOCOL* DevicePathUtils = nullptr;
-    auto Status = gBS->LocateProtocol(
-        &gEfiDevicePathUtilitiesProtocolGuid,
-        nullptr,
-        (void**)&DevicePathUtils);
-    if (EFI_ERROR(Status))
+    size_t Size = 0;
+    auto Node = DevicePath;
+    while (Node->Type != END_DEVICE_PATH_TYPE || Node->SubType != END_ENTIRE_DEVICE_PATH_SUBTYPE)
     {
-        return Status;
+        auto Length = (size_t)Node->Length[0] | ((size_t)Node->Length[1] << 8);
+        if (Length < sizeof(EFI_DEVICE_PATH))
+        {
+            return SIZE_MAX;
+        }
+
+        Size += Length;
+        Node = RVA<EFI_DEVICE_PATH*>(Node, Length);
     }
 
+    return Size;
+}
+
+EFI_STATUS EfiFileDevicePath(EFI_HANDLE Device, const wchar_t* FileName, EFI_DEVICE_PATH** NewDevicePath)
+{
     // Query the device's device path
     EFI_DEVICE_PATH* DevicePath = nullptr;
-    Status = gBS->HandleProtocol(Device, &gEfiDevicePathProtocolGuid, (void**)&DevicePath);
+    auto Status = gBS->HandleProtocol(Device, &gEfiDevicePathProtocolGuid, (void**)&DevicePath);
     if (EFI_ERROR(Status))
     {
         return Status;
     }
 
-    // Allocate a file path
+    auto DevicePathSize = EfiDevicePathSize(DevicePath);
+    if (DevicePathSize == SIZE_MAX)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    // Allocate the device path, the file path node and the end node at once
     auto FileNameSize = (wcslen(FileName) + 1) * sizeof(wchar_t);
     auto FilePathSize = FileNameSize + SIZE_OF_FILEPATH_DEVICE_PATH;
 
-    FILEPATH_DEVICE_PATH* FilePath = nullptr;
-    Status = gBS->AllocatePool(EfiBootServicesData, FilePathSize + sizeof(EFI_DEVICE_PATH), (void**)&FilePath);
-
-    if (EFI_ERROR(Status))
+    auto NewPath = (EFI_DEVICE_PATH*)ArenaAllocate(gTransientArena, DevicePathSize + FilePathSize + sizeof(EFI_DEVICE_PATH));
+    if (NewPath == nullptr)
     {
-        return Status;
+        return EFI_OUT_OF_RESOURCES;
     }
 
+    memcpy(NewPath, DevicePath, DevicePathSize);
+
     // Setup file path node
+    auto FilePath = RVA<FILEPATH_DEVICE_PATH*>(NewPath, DevicePathSize);
     FilePath->Header.Type = MEDIA_DEVICE_PATH;
     FilePath->Header.SubType = MEDIA_FILEPATH_DP;
     FilePath->Header.Length[0] = (uint8_t)(FilePathSize & 0xFF);
@@ -63,87 +83,124 @@ EFI_STATUS EfiFileDevicePath(EFI_HANDLE Device, const wchar_t* FileName, EFI_DEV
     EndPath->Length[0] = (uint8_t)sizeof(EFI_DEVICE_PATH);
     EndPath->Length[1] = 0;
 
-    // Append the file path to the device path
-    auto NewPath = DevicePathUtils->AppendDevicePath(DevicePath, (EFI_DEVICE_PATH*)FilePath);
-    gBS->FreePool(FilePath);
+    // Store the new device path
+    *NewDevicePath = NewPath;
+
+    return EFI_SUCCESS;
+}
 
-    if (NewPath == nullptr)
+// Opens the file on the filesystem of the handle and creates its device path
+static EFI_STATUS EfiQueryDeviceFile(EFI_HANDLE Handle, const wchar_t* FilePath, EFI_DEVICE_PATH** OutDevicePath)
+{
+    // Open the filesystem
+    EFI_FILE_IO_INTERFACE* FileSystem = nullptr;
+    auto Status = gBS->OpenProtocol(
+        Handle, &gEfiSimpleFileSystemProtocolGuid, (void**)&FileSystem, gImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+    if (EFI_ERROR(Status))
     {
-        return EFI_NOT_FOUND;
+        return Status;
     }
 
-    // Store the new device path
-    *NewDevicePath = NewPath;
+    // Open the volume
+    EFI_FILE_HANDLE Volume = nullptr;
+    Status = FileSystem->OpenVolume(FileSystem, &Volume);
+    if (!EFI_ERROR(Status))
+    {
+        // Open the file path
+        EFI_FILE_HANDLE File = nullptr;
+        Status = Volume->Open(Volume, &File, (CHAR16*)FilePath, EFI_FILE_MODE_READ, 0);
+        if (!EFI_ERROR(Status))
+        {
+            // Create a device path for the file
+            Status = EfiFileDevicePath(Handle, FilePath, OutDevicePath);
 
-    return EFI_SUCCESS;
+            File->Close(File);
+        }
+
+        Volume->Close(Volume);
+    }
+
+    gBS->CloseProtocol(Handle, &gEfiSimpleFileSystemProtocolGuid, gImageHandle, nullptr);
+
+    return Status;
 }
 
 EFI_STATUS EfiQueryDevicePath(const wchar_t* FilePath, EFI_DEVICE_PATH** OutDevicePath)
 {
-    EFI_DEVICE_PATH* DevicePath = nullptr;
+    // The bootkit is normally started from the ESP that holds the boot manager, try its device first
+    EFI_HANDLE DeviceHandle = nullptr;
+    EFI_LOADED_IMAGE* LoadedImage = nullptr;
+    auto Status = gBS->HandleProtocol(gImageHandle, &gEfiLoadedImageProtocolGuid, (void**)&LoadedImage);
+    if (!EFI_ERROR(Status) && LoadedImage->DeviceHandle != nullptr)
+    {
+        DeviceHandle = LoadedImage->DeviceHandle;
+        Status = EfiQueryDeviceFile(DeviceHandle, FilePath, OutDevicePath);
+        if (!EFI_ERROR(Status))
+        {
+            return Status;
+        }
+    }
 
     // Get filesystem handles
     size_t Count = 0;
     EFI_HANDLE* Handles = nullptr;
-    auto Status =
-        gBS->LocateHandleBuffer(ByProtocol, &gEfiSimpleFileSystemProtocolGuid, NULL, &Count, &Handles);
+    Status = EfiLocateHandles(&gEfiSimpleFileSystemProtocolGuid, &Count, &Handles);
     if (EFI_ERROR(Status))
     {
         return Status;
     }
 
-    // Enumerate filesystem handles until buffer is valid
-    for (size_t i = 0; i < Count && (DevicePath == nullptr); i++)
+    // Enumerate the other filesystem handles until the file is found
+    Status = EFI_NOT_FOUND;
+    for (size_t i = 0; i < Count; i++)
     {
-        auto Handle = Handles[i];
-
-        // Open the filesystem
-        EFI_FILE_IO_INTERFACE* FileSystem = nullptr;
-        Status = gBS->OpenProtocol(
-            Handle, &gEfiSimpleFileSystemProtocolGuid, (void**)&FileSystem, gImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
-        if (EFI_ERROR(Status))
+        if (Handles[i] == DeviceHandle)
         {
             continue;
         }
 
-        // Open the volume
-        EFI_FILE_HANDLE Volume = nullptr;
-        Status = FileSystem->OpenVolume(FileSystem, &Volume);
+        Status = EfiQueryDeviceFile(Handles[i], FilePath, OutDevicePath);
         if (!EFI_ERROR(Status))
         {
-            // Open the file path
-            EFI_FILE_HANDLE File = nullptr;
-            Status = Volume->Open(Volume, &File, (CHAR16*)FilePath, EFI_FILE_MODE_READ, 0);
-            if (!EFI_ERROR(Status))
-            {
-                // Create a device path for the file
-                Status = EfiFileDevicePath(Handle, FilePath, &DevicePath);
-                if (!EFI_ERROR(Status))
-                {
-                    // Store the result
-                    *OutDevicePath = DevicePath;
-                }
-                else
-                {
-                    DevicePath = nullptr;
-                }
-
-                File->Close(File);
-            }
-
-            Volume->Close(Volume);
+            break;
         }
+    }
+
+    return Status;
+}
 
-        gBS->CloseProtocol(Handle, &gEfiSimpleFileSystemProtocolGuid, gImageHandle, nullptr);
+EFI_STATUS EfiLocateHandles(EFI_GUID* Protocol, size_t* Count, EFI_HANDLE** Handles)
+{
+    // Query the size first, the buffer comes from the arena instead of the pool LocateHandleBuffer uses
+    UINTN BufferSize = 0;
+    auto Status = gBS->LocateHandle(ByProtocol, Protocol, nullptr, &BufferSize, nullptr);
+    if (Status != EFI_BUFFER_TOO_SMALL)
+    {
+        return EFI_ERROR(Status) ? Status : EFI_NOT_FOUND;
     }
 
-    gBS->FreePool(Handles);
+    auto Buffer = (EFI_HANDLE*)ArenaAllocate(gTransientArena, BufferSize);
+    if (Buffer == nullptr)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
 
-    return Status;
+    Status = gBS->LocateHandle(ByProtocol, Protocol, nullptr, &BufferSize, Buffer);
+    if (EFI_ERROR(Status))
+    {
+        return Status;
+    }
+
+    *Count = BufferSize / sizeof(EFI_HANDLE);
+    *Handles = Buffer;
+
+    return EFI_SUCCESS;
 }
 
 void* EfiRelocateImage(void* ImageBase)
 {
+    auto TraceStart = TraceBegin();
+
     // Get the headers
     auto NtHeaders = GetNtHeaders(ImageBase);
 
@@ -164,10 +221,37 @@ void* EfiRelocateImage(void* ImageBase)
         return nullptr;
     }
 
-    // Copy the image data
+    // Copy the headers and every section, the alignment padding in between is only zeroed.
+    // The sections are copied up to their VirtualSize from the loaded image because the
+    // zero-filled tails hold the globals set before the relocation (gBS, gTraceBuffer, ...)
     auto NewImageBase = (void*)NewAddress;
+    auto SizeOfHeaders = std::min<size_t>(NtHeaders->OptionalHeader.SizeOfHeaders, ImageSize);
+    auto Sections = RVA<EFI_IMAGE_SECTION_HEADER*>(&NtHeaders->OptionalHeader, NtHeaders->FileHeader.SizeOfOptionalHeader);
+
+    memcpy(NewImageBase, ImageBase, SizeOfHeaders);
+
+    auto CopiedSize = SizeOfHeaders;
+    auto Cursor = SizeOfHeaders;
+    for (int i = 0; i < NtHeaders->FileHeader.NumberOfSections; i++)
+    {
+        // Sections are sorted by their virtual address
+        auto Start = std::min<size_t>(std::max<size_t>(Sections[i].VirtualAddress, Cursor), ImageSize);
+        auto End = std::min<size_t>((size_t)Sections[i].VirtualAddress + Sections[i].Misc.VirtualSize, ImageSize);
+
+        memset(RVA<void*>(NewImageBase, Cursor), 0, Start - Cursor);
+        if (End > Start)
+        {
+            memcpy(RVA<void*>(NewImageBase, Start), RVA<void*>(ImageBase, Start), End - Start);
+            CopiedSize += End - Start;
+            Cursor = End;
+        }
+        else
+        {
+            Cursor = Start;
+        }
+    }
 
-    memcpy(NewImageBase, ImageBase, ImageSize);
+    memset(RVA<void*>(NewImageBase, Cursor), 0, ImageSize - Cursor);
 
     // Fix the relocations
     if (!FixRelocations(NewImageBase, (uint64_t)NewImageBase - (uint64_t)ImageBase))
@@ -177,36 +261,26 @@ void* EfiRelocateImage(void* ImageBase)
         return nullptr;
     }
 
+    TraceEnd(TraceEfiRelocateImage, TraceStart, 0, CopiedSize);
+
     return NewImageBase;
 }
 
+// Size dispatched implementations in Memory.cpp
 #pragma function(memcmp)
 int memcmp(const void* Dest, const void* Source, size_t Size)
 {
-    int32_t Value = 0;
-    uint8_t* Ptr1 = (uint8_t*)Dest;
-    uint8_t* Ptr2 = (uint8_t*)Source;
-
-    while (Size-- > 0 && Value == 0)
-    {
-        Value = *(Ptr1++) - *(Ptr2++);
-    }
-
-    return Value;
+    return MemoryCompare(Dest, Source, Size);
 }
 
 #pragma function(memcpy)
 void* memcpy(void* Target, const void* Source, size_t Size)
 {
-    __movsb((uint8_t*)Target, (uint8_t*)Source, Size);
-
-    return Target;
+    return MemoryCopy(Target, Source, Size);
 }
 
 #pragma function(memset)
 void* memset(void* Target, int32_t Value, size_t Size)
 {
-    __stosb((uint8_t*)Target, (uint8_t)Value, Size);
-
-    return Target;
+    return MemorySet(Target, (uint8_t)Value, Size);
 }
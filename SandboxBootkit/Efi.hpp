@@ -3,6 +3,15 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+
+#ifdef BOOTKIT_HOST
+// Regular program (benchmarks, tools), see HostEfi.hpp
+#include "HostEfi.hpp"
+
+// Scratch state of the scan routines, the host tools call them from several threads
+#define BOOTKIT_THREAD_LOCAL thread_local
+#else
+#define BOOTKIT_THREAD_LOCAL
 #include <intrin.h>
 
 // Modified version for C++ compatibility
@@ -16,19 +25,25 @@ extern "C"
 #include <Uefi.h>
 #include <Protocol/SimpleFileSystem.h>
 #include <Protocol/LoadedImage.h>
-#include <Protocol/DevicePathUtilities.h>
+#include <Protocol/DevicePath.h>
 #include <IndustryStandard/PeImage.h>
 }
+#endif
 
 #include "EfiUtils.hpp"
 
+extern EFI_BOOT_SERVICES* gBS;
+
+#ifndef BOOTKIT_HOST
 extern "C" EFI_IMAGE_DOS_HEADER __ImageBase;
 
 extern EFI_HANDLE gImageHandle;
 extern EFI_SYSTEM_TABLE* gST;
-extern EFI_BOOT_SERVICES* gBS;
 
 void EfiInitializeGlobals(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable);
+// The device paths and handle buffers are allocated from gTransientArena, free them with an ArenaScope
 EFI_STATUS EfiFileDevicePath(EFI_HANDLE Device, const wchar_t* FileName, EFI_DEVICE_PATH** NewDevicePath);
 EFI_STATUS EfiQueryDevicePath(const wchar_t* FilePath, EFI_DEVICE_PATH** OutDevicePath);
-void* EfiRelocateImage(void* ImageBase);
\ No newline at end of file
+EFI_STATUS EfiLocateHandles(EFI_GUID* Protocol, size_t* Count, EFI_HANDLE** Handles);
+void* EfiRelocateImage(void* ImageBase);
+#endif
\ No newline at end of file
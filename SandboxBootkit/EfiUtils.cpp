@@ -49,50 +49,283 @@ void* FindImageBase(uint64_t Address, size_t MaxSize)
     return ImageBase;
 }
 
-void* GetExport(void* ImageBase, const char* FunctionName, const char* ModuleName)
+// Null (and a zero size) if the directory is missing or does not fit into the image
+static void* GetDirectory(const PeImage& Image, uint32_t Index, uint32_t MinSize, uint32_t* Size = nullptr)
 {
-    auto NtHeaders = GetNtHeaders(ImageBase);
+    auto DataDir = &Image.NtHeaders->OptionalHeader.DataDirectory[Index];
+    auto Found = Index < Image.NtHeaders->OptionalHeader.NumberOfRvaAndSizes && DataDir->VirtualAddress != 0 &&
+        DataDir->Size != 0 && DataDir->Size >= MinSize && Image.Contains(DataDir->VirtualAddress, DataDir->Size);
 
-    if (NtHeaders == nullptr)
+    if (Size != nullptr)
+    {
+        *Size = Found ? DataDir->Size : 0;
+    }
+
+    return Found ? RVA<void*>(Image.Base, DataDir->VirtualAddress) : nullptr;
+}
+
+PeImage::PeImage(void* ImageBase, uint64_t ImageSize)
+{
+    Base = (uint8_t*)ImageBase;
+    Size = ImageSize;
+    NtHeaders = nullptr;
+    Sections = nullptr;
+    SectionCount = 0;
+    ExportDirectory = nullptr;
+    Functions = nullptr;
+    FunctionCount = 0;
+    Relocations = nullptr;
+    RelocationsSize = 0;
+
+    auto DosHeader = (EFI_IMAGE_DOS_HEADER*)ImageBase;
+    if (DosHeader == nullptr || (Size != 0 && Size < sizeof(EFI_IMAGE_DOS_HEADER)) || DosHeader->e_magic != EFI_IMAGE_DOS_SIGNATURE)
+    {
+        return;
+    }
+
+    auto HeadersRva = (uint32_t)DosHeader->e_lfanew;
+    if (Size != 0 && !Contains(HeadersRva, sizeof(EFI_IMAGE_NT_HEADERS64)))
+    {
+        return;
+    }
+
+    auto Headers = RVA<EFI_IMAGE_NT_HEADERS64*>(ImageBase, HeadersRva);
+    if (Headers->Signature != EFI_IMAGE_NT_SIGNATURE || Headers->OptionalHeader.Magic != EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+    {
+        return;
+    }
+
+    // Without a size the headers are trusted up to SizeOfImage
+    if (Size == 0)
+    {
+        Size = Headers->OptionalHeader.SizeOfImage;
+    }
+
+    auto SectionsRva = (uint64_t)HeadersRva + sizeof(uint32_t) + sizeof(EFI_IMAGE_FILE_HEADER) + Headers->FileHeader.SizeOfOptionalHeader;
+    if (!Contains(HeadersRva, sizeof(EFI_IMAGE_NT_HEADERS64)) ||
+        !Contains(SectionsRva, Headers->FileHeader.NumberOfSections * sizeof(EFI_IMAGE_SECTION_HEADER)))
+    {
+        return;
+    }
+
+    NtHeaders = Headers;
+    Sections = RVA<EFI_IMAGE_SECTION_HEADER*>(ImageBase, SectionsRva);
+    SectionCount = Headers->FileHeader.NumberOfSections;
+
+    // The lookups index the name, ordinal and function tables, they have to fit as well
+    auto ExportDir = (EFI_IMAGE_EXPORT_DIRECTORY*)GetDirectory(*this, EFI_IMAGE_DIRECTORY_ENTRY_EXPORT, sizeof(EFI_IMAGE_EXPORT_DIRECTORY));
+    if (ExportDir != nullptr && Contains(ExportDir->Name, 1) &&
+        Contains(ExportDir->AddressOfNames, (uint64_t)ExportDir->NumberOfNames * sizeof(uint32_t)) &&
+        Contains(ExportDir->AddressOfNameOrdinals, (uint64_t)ExportDir->NumberOfNames * sizeof(uint16_t)) &&
+        Contains(ExportDir->AddressOfFunctions, (uint64_t)ExportDir->NumberOfFunctions * sizeof(uint32_t)))
+    {
+        ExportDirectory = ExportDir;
+    }
+
+    uint32_t FunctionsSize = 0;
+    Functions = (RUNTIME_FUNCTION*)GetDirectory(*this, EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION, sizeof(RUNTIME_FUNCTION), &FunctionsSize);
+    FunctionCount = FunctionsSize / sizeof(RUNTIME_FUNCTION);
+
+    Relocations = (EFI_IMAGE_BASE_RELOCATION*)GetDirectory(*this, EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC, EFI_IMAGE_SIZEOF_BASE_RELOCATION, &RelocationsSize);
+}
+
+static EFI_IMAGE_EXPORT_DIRECTORY* GetExportDirectory(const PeImage& Image, uint64_t ModuleHash)
+{
+    auto ExportDir = Image.ExportDirectory;
+
+    if (ExportDir == nullptr)
+    {
+        return nullptr;
+    }
+
+    auto ExportModuleName = RVA<char*>(Image.Base, ExportDir->Name);
+
+    if (ModuleHash != 0 && Fnv1a(ExportModuleName) != ModuleHash)
+    {
+        return nullptr;
+    }
+
+    return ExportDir;
+}
+
+static uint32_t* FindExportName(void* ImageBase, uint32_t* Names, uint32_t* SearchBegin, uint32_t* End, const char* FunctionName)
+{
+    // The name table is sorted (by the linker) so the loader can do a binary search too
+    auto Found = std::lower_bound(SearchBegin, End, FunctionName, [ImageBase](uint32_t NameRva, const char* FunctionName)
+        {
+            return strcmp(RVA<char*>(ImageBase, NameRva), FunctionName) < 0;
+        });
+
+    if (Found != End && strcmp(RVA<char*>(ImageBase, *Found), FunctionName) == 0)
+    {
+        return Found;
+    }
+
+    // The table is sorted case-sensitively but lookups ignore the case, so misses fall back to a linear Fnv1a compare
+    auto FunctionHash = Fnv1a(FunctionName);
+
+    for (auto Name = Names; Name != End; Name++)
+    {
+        if (Fnv1a(RVA<char*>(ImageBase, *Name)) == FunctionHash)
+        {
+            return Name;
+        }
+    }
+
+    return nullptr;
+}
+
+static void* GetExportAddress(void* ImageBase, EFI_IMAGE_EXPORT_DIRECTORY* ExportDir, uint32_t NameIndex)
+{
+    auto ExportFuncs = RVA<uint32_t*>(ImageBase, ExportDir->AddressOfFunctions);
+    auto ExportOrds = RVA<uint16_t*>(ImageBase, ExportDir->AddressOfNameOrdinals);
+
+    if (ExportOrds[NameIndex] >= ExportDir->NumberOfFunctions)
     {
         return nullptr;
     }
 
-    auto DataDir =
-        &NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT];
+    return RVA<void*>(ImageBase, ExportFuncs[ExportOrds[NameIndex]]);
+}
+
+void* PeImage::GetExport(const char* FunctionName, uint64_t ModuleHash) const
+{
+    auto ExportDir = GetExportDirectory(*this, ModuleHash);
 
-    if (DataDir->VirtualAddress == 0 || DataDir->Size == 0)
+    if (ExportDir == nullptr)
     {
         return nullptr;
     }
 
-    auto ExportDir = RVA<EFI_IMAGE_EXPORT_DIRECTORY*>(ImageBase, DataDir->VirtualAddress);
-    auto ExportModuleName = RVA<char*>(ImageBase, ExportDir->Name);
+    auto ExportNames = RVA<uint32_t*>(Base, ExportDir->AddressOfNames);
+    auto ExportNamesEnd = ExportNames + ExportDir->NumberOfNames;
+    auto ExportName = FindExportName(Base, ExportNames, ExportNames, ExportNamesEnd, FunctionName);
 
-    if (ModuleName != nullptr && Fnv1a(ExportModuleName) != Fnv1a(ModuleName))
+    if (ExportName == nullptr)
     {
         return nullptr;
     }
 
-    auto ExportNames = RVA<uint32_t*>(ImageBase, ExportDir->AddressOfNames);
+    return GetExportAddress(Base, ExportDir, (uint32_t)(ExportName - ExportNames));
+}
 
-    for (uint32_t i = 0; i < ExportDir->NumberOfNames; ++i)
+size_t PeImage::GetExports(const char* const* FunctionNames, void** Exports, size_t Count, uint64_t ModuleHash) const
+{
+    for (size_t i = 0; i < Count; i++)
     {
-        auto ExportFunctionName = RVA<char*>(ImageBase, ExportNames[i]);
+        Exports[i] = nullptr;
+    }
 
-        if (Fnv1a(ExportFunctionName) == Fnv1a(FunctionName))
+    auto ExportDir = GetExportDirectory(*this, ModuleHash);
+
+    if (ExportDir == nullptr)
+    {
+        return 0;
+    }
+
+    auto ExportNames = RVA<uint32_t*>(Base, ExportDir->AddressOfNames);
+    auto ExportNamesEnd = ExportNames + ExportDir->NumberOfNames;
+    auto SearchBegin = ExportNames;
+    size_t Resolved = 0;
+
+    for (size_t i = 0; i < Count; i++)
+    {
+        // Names passed in sorted order only search the remainder of the table
+        if (i > 0 && strcmp(FunctionNames[i], FunctionNames[i - 1]) < 0)
         {
-            auto ExportFuncs = RVA<uint32_t*>(ImageBase, ExportDir->AddressOfFunctions);
-            auto ExportOrds = RVA<uint16_t*>(ImageBase, ExportDir->AddressOfNameOrdinals);
+            SearchBegin = ExportNames;
+        }
+
+        auto ExportName = FindExportName(Base, ExportNames, SearchBegin, ExportNamesEnd, FunctionNames[i]);
 
-            return RVA<void*>(ImageBase, ExportFuncs[ExportOrds[i]]);
+        if (ExportName != nullptr)
+        {
+            Exports[i] = GetExportAddress(Base, ExportDir, (uint32_t)(ExportName - ExportNames));
+            Resolved += Exports[i] != nullptr;
+
+            // Only exact matches keep the sorted search position
+            if (strcmp(RVA<char*>(Base, *ExportName), FunctionNames[i]) == 0)
+            {
+                SearchBegin = ExportName;
+            }
         }
     }
 
-    return nullptr;
+    return Resolved;
 }
 
-bool FixRelocations(void* ImageBase, uint64_t ImageBaseDelta)
+void* GetExport(void* ImageBase, const char* FunctionName, uint64_t ModuleHash)
+{
+    return PeImage(ImageBase).GetExport(FunctionName, ModuleHash);
+}
+
+size_t GetExports(void* ImageBase, const char* const* FunctionNames, void** Exports, size_t Count, uint64_t ModuleHash)
+{
+    return PeImage(ImageBase).GetExports(FunctionNames, Exports, Count, ModuleHash);
+}
+
+uint32_t GetImageFileSize(const void* FileData, size_t FileSize)
+{
+    if (FileSize < sizeof(EFI_IMAGE_DOS_HEADER))
+    {
+        return 0;
+    }
+
+    auto DosHeader = (const EFI_IMAGE_DOS_HEADER*)FileData;
+    if (DosHeader->e_magic != EFI_IMAGE_DOS_SIGNATURE || (uint64_t)DosHeader->e_lfanew + sizeof(EFI_IMAGE_NT_HEADERS64) > FileSize)
+    {
+        return 0;
+    }
+
+    auto NtHeaders = RVA<const EFI_IMAGE_NT_HEADERS64*>(FileData, DosHeader->e_lfanew);
+    if (NtHeaders->Signature != EFI_IMAGE_NT_SIGNATURE || NtHeaders->OptionalHeader.Magic != EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+    {
+        return 0;
+    }
+
+    // The section headers have to be in the file as well
+    auto SectionsEnd = (uint64_t)DosHeader->e_lfanew + sizeof(uint32_t) + sizeof(EFI_IMAGE_FILE_HEADER) + NtHeaders->FileHeader.SizeOfOptionalHeader +
+        NtHeaders->FileHeader.NumberOfSections * sizeof(EFI_IMAGE_SECTION_HEADER);
+    if (SectionsEnd > FileSize || SectionsEnd > NtHeaders->OptionalHeader.SizeOfImage)
+    {
+        return 0;
+    }
+
+    return NtHeaders->OptionalHeader.SizeOfImage;
+}
+
+bool MapImageFile(const void* FileData, size_t FileSize, void* Image, size_t ImageSize)
+{
+    auto SizeOfImage = GetImageFileSize(FileData, FileSize);
+    if (SizeOfImage == 0 || ImageSize < SizeOfImage)
+    {
+        return false;
+    }
+
+    auto NtHeaders = GetNtHeaders((void*)FileData);
+    auto SizeOfHeaders = std::min<size_t>(std::min<size_t>(NtHeaders->OptionalHeader.SizeOfHeaders, FileSize), SizeOfImage);
+
+    memset(Image, 0, SizeOfImage);
+    memcpy(Image, FileData, SizeOfHeaders);
+
+    // Copy the sections to their virtual addresses, the rest stays zero
+    auto Sections = RVA<EFI_IMAGE_SECTION_HEADER*>(&NtHeaders->OptionalHeader, NtHeaders->FileHeader.SizeOfOptionalHeader);
+    for (int i = 0; i < NtHeaders->FileHeader.NumberOfSections; i++)
+    {
+        auto Section = &Sections[i];
+        auto RawSize = std::min(Section->SizeOfRawData, Section->Misc.VirtualSize);
+        if ((uint64_t)Section->PointerToRawData + RawSize > FileSize || (uint64_t)Section->VirtualAddress + RawSize > SizeOfImage)
+        {
+            return false;
+        }
+
+        memcpy(RVA<void*>(Image, Section->VirtualAddress), RVA<const void*>(FileData, Section->PointerToRawData), RawSize);
+    }
+
+    return true;
+}
+
+bool PeImage::FixRelocations(uint64_t ImageBaseDelta) const
 {
     // Check if relocations are already applied to the image
     if (ImageBaseDelta == 0)
@@ -100,25 +333,28 @@ bool FixRelocations(void* ImageBase, uint64_t ImageBaseDelta)
         return true;
     }
 
-    auto NtHeaders = GetNtHeaders(ImageBase);
     if (NtHeaders == nullptr)
     {
         return false;
     }
 
-    auto DataDir =
-        &NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC];
-    if (DataDir->VirtualAddress == 0 || DataDir->Size == 0)
+    // A missing relocation directory is fine, one that does not fit into the image is not
+    if (Relocations == nullptr)
     {
-        return true;
+        auto DataDir = &NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC];
+        return DataDir->VirtualAddress == 0 || DataDir->Size == 0;
     }
 
-    auto BaseReloc =
-        RVA<EFI_IMAGE_BASE_RELOCATION*>(ImageBase, DataDir->VirtualAddress);
-    auto RelocsSize = DataDir->Size;
+    auto BaseReloc = Relocations;
+    auto RelocsSize = RelocationsSize;
 
-    while (RelocsSize > 0 && BaseReloc->SizeOfBlock)
+    while (RelocsSize >= EFI_IMAGE_SIZEOF_BASE_RELOCATION && BaseReloc->SizeOfBlock)
     {
+        if (BaseReloc->SizeOfBlock < EFI_IMAGE_SIZEOF_BASE_RELOCATION || BaseReloc->SizeOfBlock > RelocsSize)
+        {
+            return false;
+        }
+
         auto NumberOfRelocs = (BaseReloc->SizeOfBlock - EFI_IMAGE_SIZEOF_BASE_RELOCATION) / sizeof(uint16_t);
         auto Relocs = RVA<uint16_t*>(BaseReloc, 8);
 
@@ -129,9 +365,9 @@ bool FixRelocations(void* ImageBase, uint64_t ImageBaseDelta)
             {
                 auto RelocType = (Reloc & 0xF000) >> 12;
                 auto RelocRva = BaseReloc->VirtualAddress + (Reloc & 0xFFF);
-                auto RelocPtr = RVA<uint64_t*>(ImageBase, RelocRva);
+                auto RelocPtr = RVA<uint64_t*>(Base, RelocRva);
 
-                if (RelocType == EFI_IMAGE_REL_BASED_DIR64)
+                if (RelocType == EFI_IMAGE_REL_BASED_DIR64 && Contains(RelocRva, sizeof(uint64_t)))
                 {
                     *RelocPtr += ImageBaseDelta;
                 }
@@ -142,41 +378,25 @@ bool FixRelocations(void* ImageBase, uint64_t ImageBaseDelta)
             }
         }
 
+        RelocsSize -= BaseReloc->SizeOfBlock;
         BaseReloc =
             RVA<EFI_IMAGE_BASE_RELOCATION*>(BaseReloc, BaseReloc->SizeOfBlock);
-        RelocsSize -= BaseReloc->SizeOfBlock;
     }
 
     return true;
 }
 
-struct RUNTIME_FUNCTION
+uint8_t* PeImage::FindFunctionStart(const void* Address) const
 {
-    uint32_t BeginAddress;
-    uint32_t EndAddress;
-    uint32_t UnwindInfo;
-};
-
-#define RUNTIME_FUNCTION_INDIRECT 0x1
-
-uint8_t* FindFunctionStart(void* ImageBase, void* Address)
-{
-    auto NtHeaders = GetNtHeaders(ImageBase);
-    if (NtHeaders == nullptr)
-    {
-        return nullptr;
-    }
-
-    auto ExceptionDirectory = &NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION];
-    if (ExceptionDirectory->VirtualAddress == 0 || ExceptionDirectory->Size == 0)
+    if (Functions == nullptr || (uint8_t*)Address < Base || (uint64_t)((uint8_t*)Address - Base) >= Size)
     {
         return nullptr;
     }
 
     // Do a binary search to find the RUNTIME_FUNCTION
-    auto Rva = (uint32_t)((uint8_t*)Address - (uint8_t*)ImageBase);
-    auto Begin = RVA<RUNTIME_FUNCTION*>(ImageBase, ExceptionDirectory->VirtualAddress);
-    auto End = Begin + ExceptionDirectory->Size / sizeof(RUNTIME_FUNCTION);
+    auto Rva = (uint32_t)((uint8_t*)Address - Base);
+    auto Begin = Functions;
+    auto End = Begin + FunctionCount;
     auto FoundEntry = std::lower_bound(Begin, End, Rva, [](const RUNTIME_FUNCTION& Entry, uint32_t Rva)
         {
             return Entry.EndAddress < Rva;
@@ -195,28 +415,92 @@ uint8_t* FindFunctionStart(void* ImageBase, void* Address)
     if ((FoundEntry->UnwindInfo & RUNTIME_FUNCTION_INDIRECT) != 0)
     {
         auto OwningEntryRva = FoundEntry->UnwindInfo - RUNTIME_FUNCTION_INDIRECT;
-        FoundEntry = RVA<RUNTIME_FUNCTION*>(ImageBase, OwningEntryRva);
+        FoundEntry = RVA<RUNTIME_FUNCTION*>(Base, OwningEntryRva);
+
+        // The owning entry is part of the same table
+        if (FoundEntry < Begin || FoundEntry + 1 > End)
+        {
+            return nullptr;
+        }
     }
 
-    return RVA<uint8_t*>(ImageBase, FoundEntry->BeginAddress);
+    return RVA<uint8_t*>(Base, FoundEntry->BeginAddress);
 }
 
-EFI_IMAGE_SECTION_HEADER* FindSection(void* ImageBase, const char* SectionName)
+bool FixRelocations(void* ImageBase, uint64_t ImageBaseDelta)
 {
-    auto NtHeaders = GetNtHeaders(ImageBase);
-    if (NtHeaders == nullptr)
+    return PeImage(ImageBase).FixRelocations(ImageBaseDelta);
+}
+
+uint8_t* FindFunctionStart(void* ImageBase, void* Address)
+{
+    return PeImage(ImageBase).FindFunctionStart(Address);
+}
+
+bool IsSectionMatch(const EFI_IMAGE_SECTION_HEADER* Section, uint32_t Filter)
+{
+    auto Characteristics = Section->Characteristics;
+
+    if ((Filter & SectionExecutable) && !(Characteristics & (EFI_IMAGE_SCN_MEM_EXECUTE | EFI_IMAGE_SCN_CNT_CODE)))
     {
-        return nullptr;
+        return false;
+    }
+    if ((Filter & SectionResident) && (Characteristics & EFI_IMAGE_SCN_MEM_DISCARDABLE))
+    {
+        return false;
+    }
+    if ((Filter & SectionAccessible) && !(Characteristics & (EFI_IMAGE_SCN_MEM_READ | EFI_IMAGE_SCN_MEM_EXECUTE)))
+    {
+        return false;
     }
 
-    auto NumberOfSections = NtHeaders->FileHeader.NumberOfSections;
-    auto Sections = RVA<EFI_IMAGE_SECTION_HEADER*>(&NtHeaders->OptionalHeader, NtHeaders->FileHeader.SizeOfOptionalHeader);
-    for (int i = 0; i < NumberOfSections; i++)
+    return true;
+}
+
+ImageSections::ImageSections(void* ImageBase, uint32_t Filter)
+    : ImageSections(PeImage(ImageBase).GetSections(Filter))
+{
+}
+
+ImageSections::ImageSections(EFI_IMAGE_SECTION_HEADER* Sections, size_t SectionCount, uint32_t Filter)
+{
+    First.Section = Sections;
+    First.End = Sections + SectionCount;
+    First.Filter = Filter;
+    First.SkipFiltered();
+}
+
+EFI_IMAGE_SECTION_HEADER* PeImage::FindSection(const char* SectionName) const
+{
+    // Names are zero padded to 8 bytes, so they compare as a single integer
+    uint64_t Name = 0;
+    for (size_t i = 0; SectionName[i] != '\0'; i++)
     {
-        auto Section = &Sections[i];
-        char Name[9] = {};
-        memcpy(Name, Section->Name, 8);
-        if (strcmp(Name, SectionName) == 0)
+        if (i == EFI_IMAGE_SIZEOF_SHORT_NAME)
+        {
+            return nullptr;
+        }
+
+        Name |= (uint64_t)(uint8_t)SectionName[i] << (i * 8);
+    }
+
+    for (auto Section : GetSections())
+    {
+        if (*(uint64_t*)Section->Name == Name)
+        {
+            return Section;
+        }
+    }
+
+    return nullptr;
+}
+
+EFI_IMAGE_SECTION_HEADER* PeImage::FindSection(const void* Address, uint32_t Filter) const
+{
+    auto Rva = (uint64_t)((uint8_t*)Address - Base);
+    for (auto Section : GetSections(Filter))
+    {
+        if (Rva >= Section->VirtualAddress && Rva < (uint64_t)Section->VirtualAddress + Section->Misc.VirtualSize)
         {
             return Section;
         }
@@ -225,6 +509,11 @@ EFI_IMAGE_SECTION_HEADER* FindSection(void* ImageBase, const char* SectionName)
     return nullptr;
 }
 
+EFI_IMAGE_SECTION_HEADER* FindSection(void* ImageBase, const char* SectionName)
+{
+    return PeImage(ImageBase).FindSection(SectionName);
+}
+
 bool ComparePattern(uint8_t* Base, uint8_t* Pattern, size_t PatternLen)
 {
     for (; PatternLen; ++Base, ++Pattern, PatternLen--)
@@ -238,21 +527,321 @@ bool ComparePattern(uint8_t* Base, uint8_t* Pattern, size_t PatternLen)
     return true;
 }
 
+bool ComparePattern(uint8_t* Base, const PatternScan& Scan)
+{
+    // Without a mask 0xCC is a wildcard
+    if (Scan.Mask == nullptr)
+    {
+        return ComparePattern(Base, (uint8_t*)Scan.Pattern, Scan.PatternLen);
+    }
+
+    for (size_t i = 0; i < Scan.PatternLen; i++)
+    {
+        if (Scan.Mask[i] != 0 && Base[i] != Scan.Pattern[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool CpuSupportsAvx2()
+{
+    // -1: not queried yet, 0: unsupported, 1: supported
+    static BOOTKIT_THREAD_LOCAL int Supported = -1;
+
+    if (Supported == -1)
+    {
+        int Regs[4] = {};
+        Supported = 0;
+
+        // The firmware has to enable the AVX state (CR4.OSXSAVE + XCR0) before we can use it
+        __cpuid(Regs, 1);
+        auto OsXsave = (Regs[2] & (1 << 27)) != 0;
+        auto Avx = (Regs[2] & (1 << 28)) != 0;
+
+        if (OsXsave && Avx && (_xgetbv(0) & 6) == 6)
+        {
+            __cpuid(Regs, 0);
+            if (Regs[0] >= 7)
+            {
+                __cpuidex(Regs, 7, 0);
+                Supported = (Regs[1] & (1 << 5)) != 0;
+            }
+        }
+    }
+
+    return Supported == 1;
+}
+
+static bool PreparePatternScan(PatternScan& Scan, uint8_t* Base, size_t Size)
+{
+    Scan.Match = nullptr;
+    Scan.MatchCount = 0;
+
+    if (Scan.PatternLen == 0 || Size < Scan.PatternLen)
+    {
+        return false;
+    }
+
+    // Signatures come with their anchors planned at compile time
+    if (Scan.Mask != nullptr)
+    {
+        return true;
+    }
+
+    // Anchor on the first and last non-wildcard bytes
+    Scan.First = 0;
+    while (Scan.First < Scan.PatternLen && Scan.Pattern[Scan.First] == 0xCC)
+    {
+        Scan.First++;
+    }
+
+    // Patterns of only wildcards match at every position, there is nothing to sweep for
+    if (Scan.First == Scan.PatternLen)
+    {
+        Scan.Match = Base;
+        Scan.MatchCount = Size - Scan.PatternLen + 1;
+        return false;
+    }
+
+    Scan.Last = Scan.PatternLen - 1;
+    while (Scan.Pattern[Scan.Last] == 0xCC)
+    {
+        Scan.Last--;
+    }
+
+    return true;
+}
+
+struct PatternSweep
+{
+    PatternScan* Scans[MaxPatternScans];
+    size_t ScanCount;
+    size_t Remaining; // Patterns without a match yet
+    bool FirstOnly;   // Stop once every pattern has a match
+};
+
+static void ReportPatternMatch(PatternSweep& Sweep, PatternScan& Scan, uint8_t* Address)
+{
+    // Candidates are visited in ascending order, so the first match is the lowest address
+    if (Scan.Match == nullptr)
+    {
+        Scan.Match = Address;
+        Sweep.Remaining--;
+    }
+
+    Scan.MatchCount++;
+}
+
+static bool SweepDone(const PatternSweep& Sweep)
+{
+    return Sweep.FirstOnly && Sweep.Remaining == 0;
+}
+
+static void CheckPatternCandidates(PatternSweep& Sweep, PatternScan& Scan, uint8_t* Block, uint32_t Mask)
+{
+    while (Mask != 0)
+    {
+        unsigned long Bit = 0;
+        _BitScanForward(&Bit, Mask);
+        Mask &= Mask - 1;
+
+        if (ComparePattern(Block + Bit, Scan))
+        {
+            ReportPatternMatch(Sweep, Scan, Block + Bit);
+
+            if (Sweep.FirstOnly)
+            {
+                break;
+            }
+        }
+    }
+}
+
+// GCC and Clang only emit AVX2 instructions in functions that opt in (MSVC always does)
+#ifdef __GNUC__
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#else
+#define AVX2_FUNCTION
+#endif
+
+// Tests 32 candidate positions per pattern and iteration against the anchor bytes
+AVX2_FUNCTION static void SweepPatternsAvx2(PatternSweep& Sweep, uint8_t* Base, size_t Count, size_t& Index)
+{
+    for (; Index + 32 <= Count && !SweepDone(Sweep); Index += 32)
+    {
+        auto Block = Base + Index;
+
+        // Every pattern is tested while the block is still hot in the cache
+        for (size_t i = 0; i < Sweep.ScanCount; i++)
+        {
+            auto& Scan = *Sweep.Scans[i];
+            if (Sweep.FirstOnly && Scan.Match != nullptr)
+            {
+                continue;
+            }
+
+            auto FirstEq = _mm256_cmpeq_epi8(_mm256_set1_epi8((char)Scan.Pattern[Scan.First]), _mm256_loadu_si256((__m256i*)(Block + Scan.First)));
+            auto LastEq = _mm256_cmpeq_epi8(_mm256_set1_epi8((char)Scan.Pattern[Scan.Last]), _mm256_loadu_si256((__m256i*)(Block + Scan.Last)));
+            auto Mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(FirstEq, LastEq));
+
+            CheckPatternCandidates(Sweep, Scan, Block, Mask);
+        }
+    }
+
+    // Avoid the AVX-SSE transition penalty in the caller
+    _mm256_zeroupper();
+}
+
+// Tests 16 candidate positions per pattern and iteration against the anchor bytes
+static void SweepPatternsSse2(PatternSweep& Sweep, uint8_t* Base, size_t Count, size_t& Index)
+{
+    for (; Index + 16 <= Count && !SweepDone(Sweep); Index += 16)
+    {
+        auto Block = Base + Index;
+
+        // Every pattern is tested while the block is still hot in the cache
+        for (size_t i = 0; i < Sweep.ScanCount; i++)
+        {
+            auto& Scan = *Sweep.Scans[i];
+            if (Sweep.FirstOnly && Scan.Match != nullptr)
+            {
+                continue;
+            }
+
+            auto FirstEq = _mm_cmpeq_epi8(_mm_set1_epi8((char)Scan.Pattern[Scan.First]), _mm_loadu_si128((__m128i*)(Block + Scan.First)));
+            auto LastEq = _mm_cmpeq_epi8(_mm_set1_epi8((char)Scan.Pattern[Scan.Last]), _mm_loadu_si128((__m128i*)(Block + Scan.Last)));
+            auto Mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(FirstEq, LastEq));
+
+            CheckPatternCandidates(Sweep, Scan, Block, Mask);
+        }
+    }
+}
+
+static void SweepPatterns(uint8_t* Base, size_t Size, PatternScan* Scans, size_t ScanCount, bool FirstOnly)
+{
+    PatternSweep Sweep = {};
+    Sweep.FirstOnly = FirstOnly;
+    size_t MaxPatternLen = 0;
+
+    ASSERT(ScanCount <= MaxPatternScans);
+
+    // Patterns that need no sweep are skipped (they already report their matches)
+    for (size_t i = 0; i < ScanCount; i++)
+    {
+        if (PreparePatternScan(Scans[i], Base, Size))
+        {
+            Sweep.Scans[Sweep.ScanCount++] = &Scans[i];
+            MaxPatternLen = std::max(MaxPatternLen, Scans[i].PatternLen);
+        }
+    }
+
+    if (Sweep.ScanCount == 0)
+    {
+        return;
+    }
+
+    Sweep.Remaining = Sweep.ScanCount;
+
+    // Candidate positions shared by all patterns, the vector loops never read past them
+    auto Count = Size - MaxPatternLen + 1;
+    size_t Index = 0;
+
+    if (CpuSupportsAvx2())
+    {
+        SweepPatternsAvx2(Sweep, Base, Count, Index);
+    }
+
+    SweepPatternsSse2(Sweep, Base, Count, Index);
+
+    // Handle the remaining candidates of each pattern
+    for (size_t i = 0; i < Sweep.ScanCount; i++)
+    {
+        auto& Scan = *Sweep.Scans[i];
+        auto CandidateCount = Size - Scan.PatternLen + 1;
+
+        for (auto j = Index; j < CandidateCount; j++)
+        {
+            if (Sweep.FirstOnly && Scan.Match != nullptr)
+            {
+                break;
+            }
+
+            if (ComparePattern(&Base[j], Scan))
+            {
+                ReportPatternMatch(Sweep, Scan, &Base[j]);
+            }
+        }
+    }
+}
+
+uint8_t* FindPattern(uint8_t* Base, size_t Size, PatternScan& Scan)
+{
+    SweepPatterns(Base, Size, &Scan, 1, true);
+
+    return Scan.Match;
+}
+
 uint8_t* FindPattern(uint8_t* Base, size_t Size, uint8_t* Pattern, size_t PatternLen)
 {
-    Size -= PatternLen;
+    PatternScan Scan = {};
+    Scan.Pattern = Pattern;
+    Scan.PatternLen = PatternLen;
+
+    return FindPattern(Base, Size, Scan);
+}
+
+void FindPatterns(uint8_t* Base, size_t Size, PatternScan* Scans, size_t ScanCount)
+{
+    SweepPatterns(Base, Size, Scans, ScanCount, false);
+}
 
-    for (size_t i = 0; i <= Size; ++i)
+size_t PeImage::FindPatternsInSections(uint32_t Filter, PatternScan* Scans, size_t ScanCount) const
+{
+    ASSERT(ScanCount <= MaxPatternScans);
+
+    for (size_t i = 0; i < ScanCount; i++)
     {
-        auto Address = &Base[i];
+        Scans[i].Match = nullptr;
+        Scans[i].MatchCount = 0;
+    }
 
-        if (ComparePattern(Address, Pattern, PatternLen))
+    // Patterns do not match across sections, sweep each on its own and add up the matches
+    size_t ScannedBytes = 0;
+    for (auto Section : GetSections(Filter))
+    {
+        if (Section->VirtualAddress >= Size)
         {
-            return Address;
+            continue;
+        }
+
+        auto SectionBase = RVA<uint8_t*>(Base, Section->VirtualAddress);
+        auto SectionSize = (size_t)std::min<uint64_t>(Section->Misc.VirtualSize, Size - Section->VirtualAddress);
+
+        PatternScan SectionScans[MaxPatternScans];
+        memcpy(SectionScans, Scans, ScanCount * sizeof(PatternScan));
+        FindPatterns(SectionBase, SectionSize, SectionScans, ScanCount);
+        ScannedBytes += SectionSize;
+
+        // Sections are sorted by address, the first section with a match has the lowest one
+        for (size_t i = 0; i < ScanCount; i++)
+        {
+            if (Scans[i].Match == nullptr)
+            {
+                Scans[i].Match = SectionScans[i].Match;
+            }
+            Scans[i].MatchCount += SectionScans[i].MatchCount;
         }
     }
 
-    return nullptr;
+    return ScannedBytes;
+}
+
+size_t FindPatternsInSections(void* ImageBase, uint64_t ImageSize, uint32_t Filter, PatternScan* Scans, size_t ScanCount)
+{
+    return PeImage(ImageBase, ImageSize).FindPatternsInSections(Filter, Scans, ScanCount);
 }
 
 void __declspec(noreturn) Die()
@@ -1,23 +1,27 @@
 #pragma once
 
+#include <type_traits>
+
 static const size_t DetourSize = 12;
 static const uint64_t Fnv1aValue = 0xCBF29CE484222325;
 static const uint64_t Fnv1aPrime = 0x100000001B3;
 
-inline uint64_t Fnv1a(const char* Str)
+constexpr uint64_t Fnv1a(const char* Str)
 {
     auto Value = Fnv1aValue;
-    auto Len = (Str != nullptr) ? strlen(Str) : 0;
 
-    for (size_t i = 0; i < Len; i++)
+    for (; Str != nullptr && *Str != '\0'; Str++)
     {
-        Value ^= uint32_t((Str[i] >= 'A' && Str[i] <= 'Z') ? (Str[i] - ('A' - 'a')) : Str[i]);
+        Value ^= uint32_t((*Str >= 'A' && *Str <= 'Z') ? (*Str - ('A' - 'a')) : *Str);
         Value *= Fnv1aPrime;
     }
 
     return Value;
 }
 
+// Forces the hash of a string literal to be computed at compile time
+#define FNV1A(Str) (std::integral_constant<uint64_t, Fnv1a(Str)>::value)
+
 template<typename R, typename T>
 R RVA(T Ptr, int64_t Offset)
 {
@@ -44,14 +48,154 @@ void DetourRestore(Func* OriginalFunction, uint8_t OriginalBytes[DetourSize])
     memcpy(OriginalFunction, OriginalBytes, DetourSize);
 }
 
+struct RUNTIME_FUNCTION
+{
+    uint32_t BeginAddress;
+    uint32_t EndAddress;
+    uint32_t UnwindInfo;
+};
+
+#define RUNTIME_FUNCTION_INDIRECT 0x1
+
+static const size_t MaxPatternScans = 16;
+
+// A single pattern of a FindPatterns batch, see Signature.hpp to create one
+struct PatternScan
+{
+    // Pattern bytes (without a mask 0xCC is a wildcard, otherwise bytes with a zero mask are)
+    const uint8_t* Pattern;
+    size_t PatternLen;
+    const uint8_t* Mask;
+
+    // Lowest matching address and the number of matches in the range
+    uint8_t* Match;
+    size_t MatchCount;
+
+    // Anchor byte offsets (planned at compile time for signatures, otherwise the first and last non-wildcard bytes)
+    size_t First;
+    size_t Last;
+};
+
+// Characteristics filters of the section iterator, combined with |
+enum SectionFilter : uint32_t
+{
+    SectionAny = 0,
+    SectionExecutable = 0x1, // Code or executable memory
+    SectionResident = 0x2,   // Not discardable (INIT is freed once the kernel is initialized)
+    SectionAccessible = 0x4, // Readable or executable, the rest is mapped NOACCESS
+};
+
+bool IsSectionMatch(const EFI_IMAGE_SECTION_HEADER* Section, uint32_t Filter);
+
+struct SectionIterator
+{
+    EFI_IMAGE_SECTION_HEADER* Section;
+    EFI_IMAGE_SECTION_HEADER* End;
+    uint32_t Filter;
+
+    EFI_IMAGE_SECTION_HEADER* operator*() const
+    {
+        return Section;
+    }
+
+    bool operator!=(const SectionIterator& Other) const
+    {
+        return Section != Other.Section;
+    }
+
+    SectionIterator& operator++()
+    {
+        Section++;
+        SkipFiltered();
+        return *this;
+    }
+
+    void SkipFiltered()
+    {
+        while (Section != End && !IsSectionMatch(Section, Filter))
+        {
+            Section++;
+        }
+    }
+};
+
+// Section headers of a mapped image in address order: for (auto Section : ImageSections(ImageBase, SectionExecutable))
+struct ImageSections
+{
+    SectionIterator First;
+
+    ImageSections(void* ImageBase, uint32_t Filter = SectionAny);
+    ImageSections(EFI_IMAGE_SECTION_HEADER* Sections, size_t SectionCount, uint32_t Filter);
+
+    SectionIterator begin() const
+    {
+        return First;
+    }
+
+    SectionIterator end() const
+    {
+        return { First.End, First.End, First.Filter };
+    }
+};
+
+// Headers, sections and data directories of a mapped PE32+ image, parsed and bounds checked against the image size once.
+// Directories that do not fit are treated as missing, the free functions below build a view for every call
+struct PeImage
+{
+    uint8_t* Base;
+    uint64_t Size;
+    EFI_IMAGE_NT_HEADERS64* NtHeaders; // Null if the image is not a valid PE32+ image
+    EFI_IMAGE_SECTION_HEADER* Sections;
+    size_t SectionCount;
+    EFI_IMAGE_EXPORT_DIRECTORY* ExportDirectory;
+    RUNTIME_FUNCTION* Functions; // .pdata, sorted by address
+    size_t FunctionCount;
+    EFI_IMAGE_BASE_RELOCATION* Relocations;
+    uint32_t RelocationsSize;
+
+    // A zero size takes SizeOfImage from the headers
+    explicit PeImage(void* ImageBase, uint64_t ImageSize = 0);
+
+    bool IsValid() const
+    {
+        return NtHeaders != nullptr;
+    }
+
+    // Whether Length bytes at the RVA are inside the image
+    bool Contains(uint64_t Rva, uint64_t Length) const
+    {
+        return Rva <= Size && Length <= Size - Rva;
+    }
+
+    ImageSections GetSections(uint32_t Filter = SectionAny) const
+    {
+        return ImageSections(Sections, SectionCount, Filter);
+    }
+
+    EFI_IMAGE_SECTION_HEADER* FindSection(const char* SectionName) const;
+    EFI_IMAGE_SECTION_HEADER* FindSection(const void* Address, uint32_t Filter) const; // Section that contains the address
+    void* GetExport(const char* FunctionName, uint64_t ModuleHash = 0) const; // Case-insensitive like Fnv1a, exact names take the binary search
+    size_t GetExports(const char* const* FunctionNames, void** Exports, size_t Count, uint64_t ModuleHash = 0) const;
+    bool FixRelocations(uint64_t ImageBaseDelta) const;
+    uint8_t* FindFunctionStart(const void* Address) const;
+    size_t FindPatternsInSections(uint32_t Filter, PatternScan* Scans, size_t ScanCount) const;
+};
+
 EFI_IMAGE_NT_HEADERS64* GetNtHeaders(void* ImageBase);
 void* FindImageBase(uint64_t Address, size_t MaxSize = (1 * 1024 * 1024));
-void* GetExport(void* ImageBase, const char* FunctionName, const char* ModuleName = nullptr);
+void* GetExport(void* ImageBase, const char* FunctionName, uint64_t ModuleHash = 0);
+size_t GetExports(void* ImageBase, const char* const* FunctionNames, void** Exports, size_t Count, uint64_t ModuleHash = 0);
+uint32_t GetImageFileSize(const void* FileData, size_t FileSize);
+bool MapImageFile(const void* FileData, size_t FileSize, void* Image, size_t ImageSize);
 bool FixRelocations(void* ImageBase, uint64_t ImageBaseDelta);
 uint8_t* FindFunctionStart(void* ImageBase, void* Address);
 EFI_IMAGE_SECTION_HEADER* FindSection(void* ImageBase, const char* SectionName);
 bool ComparePattern(uint8_t* Base, uint8_t* Pattern, size_t PatternLen);
+bool ComparePattern(uint8_t* Base, const PatternScan& Scan);
 uint8_t* FindPattern(uint8_t* Base, size_t Size, uint8_t* Pattern, size_t PatternLen);
+uint8_t* FindPattern(uint8_t* Base, size_t Size, PatternScan& Scan);
+void FindPatterns(uint8_t* Base, size_t Size, PatternScan* Scans, size_t ScanCount);
+size_t FindPatternsInSections(void* ImageBase, uint64_t ImageSize, uint32_t Filter, PatternScan* Scans, size_t ScanCount);
 void __declspec(noreturn) Die();
 
 #define ASSERT(Condition) \
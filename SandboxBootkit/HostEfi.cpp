@@ -0,0 +1,64 @@
+#include <cstdlib>
+
+#include "Efi.hpp"
+
+static EFI_STATUS HostAllocatePages(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE /* MemoryType */, UINTN Pages, EFI_PHYSICAL_ADDRESS* Memory)
+{
+    if (Type != AllocateAnyPages || Memory == nullptr)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+#ifdef _MSC_VER
+    auto Address = _aligned_malloc(EFI_PAGES_TO_SIZE(Pages), EFI_PAGE_SIZE);
+#else
+    auto Address = aligned_alloc(EFI_PAGE_SIZE, EFI_PAGES_TO_SIZE(Pages));
+#endif
+    if (Address == nullptr)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    *Memory = (EFI_PHYSICAL_ADDRESS)Address;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS HostFreePages(EFI_PHYSICAL_ADDRESS Memory, UINTN /* Pages */)
+{
+#ifdef _MSC_VER
+    _aligned_free((void*)Memory);
+#else
+    free((void*)Memory);
+#endif
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS HostAllocatePool(EFI_MEMORY_TYPE /* PoolType */, UINTN Size, void** Buffer)
+{
+    if (Buffer == nullptr)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    *Buffer = malloc(Size);
+
+    return *Buffer != nullptr ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS HostFreePool(void* Buffer)
+{
+    free(Buffer);
+
+    return EFI_SUCCESS;
+}
+
+static EFI_BOOT_SERVICES HostBootServices = {
+    HostAllocatePages,
+    HostFreePages,
+    HostAllocatePool,
+    HostFreePool,
+};
+
+EFI_BOOT_SERVICES* gBS = &HostBootServices;
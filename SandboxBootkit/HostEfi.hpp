@@ -0,0 +1,272 @@
+#pragma once
+
+// Minimal EDK2 shim to build the PE helpers and patch routines as a regular (Windows or Linux) program
+// Only the types, constants and boot services used by the host-portable sources are provided
+
+#include <cstddef>
+#include <cstdlib>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#define IN
+#define OUT
+#define EFIAPI
+#define TRUE 1
+#define FALSE 0
+
+#ifndef NULL
+#define NULL nullptr
+#endif
+
+#define ARRAY_SIZE(Array) (sizeof(Array) / sizeof((Array)[0]))
+
+typedef uint8_t BOOLEAN;
+typedef uint64_t UINTN;
+typedef uint64_t EFI_STATUS;
+typedef uint64_t EFI_PHYSICAL_ADDRESS;
+typedef void* EFI_HANDLE;
+
+#define EFI_SUCCESS 0
+#define EFI_INVALID_PARAMETER (0x8000000000000002ull)
+#define EFI_OUT_OF_RESOURCES (0x8000000000000009ull)
+#define EFI_NOT_FOUND (0x800000000000000Eull)
+#define EFI_ERROR(Status) (((int64_t)(Status)) < 0)
+
+#define EFI_PAGE_SIZE 0x1000
+#define EFI_PAGE_MASK 0xFFF
+#define EFI_PAGE_SHIFT 12
+#define EFI_SIZE_TO_PAGES(Size) (((Size) >> EFI_PAGE_SHIFT) + (((Size) & EFI_PAGE_MASK) ? 1 : 0))
+#define EFI_PAGES_TO_SIZE(Pages) ((Pages) << EFI_PAGE_SHIFT)
+
+typedef enum
+{
+    AllocateAnyPages,
+    AllocateMaxAddress,
+    AllocateAddress,
+} EFI_ALLOCATE_TYPE;
+
+typedef enum
+{
+    EfiReservedMemoryType,
+    EfiLoaderCode,
+    EfiLoaderData,
+    EfiBootServicesCode,
+    EfiBootServicesData,
+    EfiRuntimeServicesCode,
+    EfiRuntimeServicesData,
+} EFI_MEMORY_TYPE;
+
+// Only the boot services the host-portable sources call, backed by the C runtime (see HostEfi.cpp)
+struct EFI_BOOT_SERVICES
+{
+    EFI_STATUS (*AllocatePages)(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE MemoryType, UINTN Pages, EFI_PHYSICAL_ADDRESS* Memory);
+    EFI_STATUS (*FreePages)(EFI_PHYSICAL_ADDRESS Memory, UINTN Pages);
+    EFI_STATUS (*AllocatePool)(EFI_MEMORY_TYPE PoolType, UINTN Size, void** Buffer);
+    EFI_STATUS (*FreePool)(void* Buffer);
+};
+
+//
+// IndustryStandard/PeImage.h
+//
+
+#define EFI_IMAGE_DOS_SIGNATURE 0x5A4D
+#define EFI_IMAGE_NT_SIGNATURE 0x00004550
+#define EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC 0x20B
+#define IMAGE_FILE_MACHINE_X64 0x8664
+
+#define EFI_IMAGE_NUMBER_OF_DIRECTORY_ENTRIES 16
+#define EFI_IMAGE_DIRECTORY_ENTRY_EXPORT 0
+#define EFI_IMAGE_DIRECTORY_ENTRY_IMPORT 1
+#define EFI_IMAGE_DIRECTORY_ENTRY_RESOURCE 2
+#define EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION 3
+#define EFI_IMAGE_DIRECTORY_ENTRY_SECURITY 4
+#define EFI_IMAGE_DIRECTORY_ENTRY_BASERELOC 5
+#define EFI_IMAGE_DIRECTORY_ENTRY_DEBUG 6
+
+#define EFI_IMAGE_SIZEOF_SHORT_NAME 8
+#define EFI_IMAGE_SCN_CNT_CODE 0x00000020
+#define EFI_IMAGE_SCN_CNT_INITIALIZED_DATA 0x00000040
+#define EFI_IMAGE_SCN_MEM_DISCARDABLE 0x02000000
+#define EFI_IMAGE_SCN_MEM_EXECUTE 0x20000000
+#define EFI_IMAGE_SCN_MEM_READ 0x40000000
+#define EFI_IMAGE_SCN_MEM_WRITE 0x80000000
+
+#define EFI_IMAGE_SIZEOF_BASE_RELOCATION 8
+#define EFI_IMAGE_REL_BASED_ABSOLUTE 0
+#define EFI_IMAGE_REL_BASED_DIR64 10
+
+struct EFI_IMAGE_DOS_HEADER
+{
+    uint16_t e_magic;
+    uint16_t e_cblp;
+    uint16_t e_cp;
+    uint16_t e_crlc;
+    uint16_t e_cparhdr;
+    uint16_t e_minalloc;
+    uint16_t e_maxalloc;
+    uint16_t e_ss;
+    uint16_t e_sp;
+    uint16_t e_csum;
+    uint16_t e_ip;
+    uint16_t e_cs;
+    uint16_t e_lfarlc;
+    uint16_t e_ovno;
+    uint16_t e_res[4];
+    uint16_t e_oemid;
+    uint16_t e_oeminfo;
+    uint16_t e_res2[10];
+    uint32_t e_lfanew;
+};
+
+struct EFI_IMAGE_FILE_HEADER
+{
+    uint16_t Machine;
+    uint16_t NumberOfSections;
+    uint32_t TimeDateStamp;
+    uint32_t PointerToSymbolTable;
+    uint32_t NumberOfSymbols;
+    uint16_t SizeOfOptionalHeader;
+    uint16_t Characteristics;
+};
+
+struct EFI_IMAGE_DATA_DIRECTORY
+{
+    uint32_t VirtualAddress;
+    uint32_t Size;
+};
+
+struct EFI_IMAGE_OPTIONAL_HEADER64
+{
+    uint16_t Magic;
+    uint8_t MajorLinkerVersion;
+    uint8_t MinorLinkerVersion;
+    uint32_t SizeOfCode;
+    uint32_t SizeOfInitializedData;
+    uint32_t SizeOfUninitializedData;
+    uint32_t AddressOfEntryPoint;
+    uint32_t BaseOfCode;
+    uint64_t ImageBase;
+    uint32_t SectionAlignment;
+    uint32_t FileAlignment;
+    uint16_t MajorOperatingSystemVersion;
+    uint16_t MinorOperatingSystemVersion;
+    uint16_t MajorImageVersion;
+    uint16_t MinorImageVersion;
+    uint16_t MajorSubsystemVersion;
+    uint16_t MinorSubsystemVersion;
+    uint32_t Win32VersionValue;
+    uint32_t SizeOfImage;
+    uint32_t SizeOfHeaders;
+    uint32_t CheckSum;
+    uint16_t Subsystem;
+    uint16_t DllCharacteristics;
+    uint64_t SizeOfStackReserve;
+    uint64_t SizeOfStackCommit;
+    uint64_t SizeOfHeapReserve;
+    uint64_t SizeOfHeapCommit;
+    uint32_t LoaderFlags;
+    uint32_t NumberOfRvaAndSizes;
+    EFI_IMAGE_DATA_DIRECTORY DataDirectory[EFI_IMAGE_NUMBER_OF_DIRECTORY_ENTRIES];
+};
+
+struct EFI_IMAGE_NT_HEADERS64
+{
+    uint32_t Signature;
+    EFI_IMAGE_FILE_HEADER FileHeader;
+    EFI_IMAGE_OPTIONAL_HEADER64 OptionalHeader;
+};
+
+struct EFI_IMAGE_SECTION_HEADER
+{
+    uint8_t Name[EFI_IMAGE_SIZEOF_SHORT_NAME];
+    union
+    {
+        uint32_t PhysicalAddress;
+        uint32_t VirtualSize;
+    } Misc;
+    uint32_t VirtualAddress;
+    uint32_t SizeOfRawData;
+    uint32_t PointerToRawData;
+    uint32_t PointerToRelocations;
+    uint32_t PointerToLinenumbers;
+    uint16_t NumberOfRelocations;
+    uint16_t NumberOfLinenumbers;
+    uint32_t Characteristics;
+};
+
+struct EFI_IMAGE_EXPORT_DIRECTORY
+{
+    uint32_t Characteristics;
+    uint32_t TimeDateStamp;
+    uint16_t MajorVersion;
+    uint16_t MinorVersion;
+    uint32_t Name;
+    uint32_t Base;
+    uint32_t NumberOfFunctions;
+    uint32_t NumberOfNames;
+    uint32_t AddressOfFunctions;
+    uint32_t AddressOfNames;
+    uint32_t AddressOfNameOrdinals;
+};
+
+struct EFI_IMAGE_BASE_RELOCATION
+{
+    uint32_t VirtualAddress;
+    uint32_t SizeOfBlock;
+};
+
+//
+// MSVC intrinsics
+//
+
+#ifndef _MSC_VER
+#define __declspec(Attribute) __attribute__((Attribute))
+
+inline void __cpuidex(int Regs[4], int Leaf, int Subleaf)
+{
+    __asm__ __volatile__("cpuid" : "=a"(Regs[0]), "=b"(Regs[1]), "=c"(Regs[2]), "=d"(Regs[3]) : "a"(Leaf), "c"(Subleaf));
+}
+
+inline void __cpuid(int Regs[4], int Leaf)
+{
+    __cpuidex(Regs, Leaf, 0);
+}
+
+// The compiler's _xgetbv requires the xsave target, the CPUID check in front of it is what makes it safe
+inline uint64_t HostXgetbv(uint32_t Register)
+{
+    uint32_t Low, High;
+    __asm__ __volatile__("xgetbv" : "=a"(Low), "=d"(High) : "c"(Register));
+    return (uint64_t)High << 32 | Low;
+}
+#define _xgetbv HostXgetbv
+
+inline uint8_t _BitScanForward(unsigned long* Index, unsigned long Mask)
+{
+    if (Mask == 0)
+    {
+        return 0;
+    }
+
+    *Index = __builtin_ctzl(Mask);
+    return 1;
+}
+
+inline void __movsb(uint8_t* Target, const uint8_t* Source, size_t Size)
+{
+    __asm__ __volatile__("rep movsb" : "+D"(Target), "+S"(Source), "+c"(Size) : : "memory");
+}
+
+inline void __stosb(uint8_t* Target, uint8_t Value, size_t Size)
+{
+    __asm__ __volatile__("rep stosb" : "+D"(Target), "+c"(Size) : "a"(Value) : "memory");
+}
+
+#define __fastfail(Code) abort()
+#define __int2c() abort()
+#define __ud2() abort()
+#endif
@@ -0,0 +1,106 @@
+#include "ImageHandlers.hpp"
+
+struct ImageHandlerSlot
+{
+    uint64_t NameHash;        // Zero for slots that were never used
+    ImageLoadHandler Handler; // Null for deregistered handlers, their slot stays part of the probe chain
+};
+
+static ImageHandlerSlot ImageHandlers[ImageHandlerSlots];
+static size_t ImageHandlerCount = 0;
+
+static_assert((ImageHandlerSlots & (ImageHandlerSlots - 1)) == 0, "ImageHandlerSlots has to be a power of two");
+
+uint64_t HashImageName(const wchar_t* Path)
+{
+    auto Value = Fnv1aValue;
+
+    // Single pass, the hash starts over after every separator
+    for (; *Path != L'\0'; Path++)
+    {
+        if (*Path == L'\\' || *Path == L'/')
+        {
+            Value = Fnv1aValue;
+            continue;
+        }
+
+        Value ^= uint32_t((*Path >= L'A' && *Path <= L'Z') ? (*Path - (L'A' - L'a')) : *Path);
+        Value *= Fnv1aPrime;
+    }
+
+    return Value;
+}
+
+static ImageHandlerSlot* FindImageHandler(uint64_t NameHash)
+{
+    for (size_t i = 0; i < ImageHandlerSlots; i++)
+    {
+        auto& Slot = ImageHandlers[(NameHash + i) & (ImageHandlerSlots - 1)];
+        if (Slot.NameHash == 0)
+        {
+            break;
+        }
+
+        if (Slot.NameHash == NameHash)
+        {
+            return &Slot;
+        }
+    }
+
+    return nullptr;
+}
+
+bool RegisterImageHandler(uint64_t NameHash, ImageLoadHandler Handler)
+{
+    if (NameHash == 0 || Handler == nullptr)
+    {
+        return false;
+    }
+
+    // A name keeps its slot after deregistration, so it can be registered again in place
+    if (auto Slot = FindImageHandler(NameHash))
+    {
+        if (Slot->Handler != nullptr)
+        {
+            return false;
+        }
+
+        Slot->Handler = Handler;
+        ImageHandlerCount++;
+        return true;
+    }
+
+    for (size_t i = 0; i < ImageHandlerSlots; i++)
+    {
+        auto& Slot = ImageHandlers[(NameHash + i) & (ImageHandlerSlots - 1)];
+        if (Slot.NameHash == 0)
+        {
+            Slot.NameHash = NameHash;
+            Slot.Handler = Handler;
+            ImageHandlerCount++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void DispatchImageLoad(const wchar_t* Path, void* ImageBase, uint64_t ImageSize)
+{
+    if (ImageHandlerCount == 0)
+    {
+        return;
+    }
+
+    auto Slot = FindImageHandler(HashImageName(Path));
+    if (Slot == nullptr || Slot->Handler == nullptr)
+    {
+        return;
+    }
+
+    if (Slot->Handler(ImageBase, ImageSize))
+    {
+        Slot->Handler = nullptr;
+        ImageHandlerCount--;
+    }
+}
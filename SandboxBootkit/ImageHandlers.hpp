@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Efi.hpp"
+
+// Power of two, the registry is an open addressing table keyed by the name hash
+static const size_t ImageHandlerSlots = 16;
+
+// Called with an image winload loaded, returns true once it is done and does not want to see later loads
+typedef bool (*ImageLoadHandler)(void* ImageBase, uint64_t ImageSize);
+
+// Case-insensitive FNV-1a of the file name after the last path separator, equals FNV1A("ntoskrnl.exe")
+uint64_t HashImageName(const wchar_t* Path);
+
+// One handler per name, fails if the name is taken or the table is full
+bool RegisterImageHandler(uint64_t NameHash, ImageLoadHandler Handler);
+
+// Hands the image to the handler of its name, returns immediately when no handlers are left
+void DispatchImageLoad(const wchar_t* Path, void* ImageBase, uint64_t ImageSize);
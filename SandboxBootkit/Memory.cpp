@@ -0,0 +1,215 @@
+#include "Memory.hpp"
+
+// Sizes up to 32 bytes (patch writes, GUIDs, signature compares) are copied with two
+// overlapping loads and stores, nothing in here may turn into a call to memcpy/memset
+
+void* MemoryCopy(void* Target, const void* Source, size_t Size)
+{
+    auto Dst = (uint8_t*)Target;
+    auto Src = (const uint8_t*)Source;
+
+    if (Size <= 16)
+    {
+        if (Size >= 8)
+        {
+            auto Head = *(const uint64_t*)Src;
+            auto Tail = *(const uint64_t*)(Src + Size - 8);
+            *(uint64_t*)Dst = Head;
+            *(uint64_t*)(Dst + Size - 8) = Tail;
+        }
+        else if (Size >= 4)
+        {
+            auto Head = *(const uint32_t*)Src;
+            auto Tail = *(const uint32_t*)(Src + Size - 4);
+            *(uint32_t*)Dst = Head;
+            *(uint32_t*)(Dst + Size - 4) = Tail;
+        }
+        else if (Size >= 2)
+        {
+            auto Head = *(const uint16_t*)Src;
+            auto Tail = *(const uint16_t*)(Src + Size - 2);
+            *(uint16_t*)Dst = Head;
+            *(uint16_t*)(Dst + Size - 2) = Tail;
+        }
+        else if (Size == 1)
+        {
+            *Dst = *Src;
+        }
+
+        return Target;
+    }
+
+    auto Head = _mm_loadu_si128((const __m128i*)Src);
+    auto Tail = _mm_loadu_si128((const __m128i*)(Src + Size - 16));
+
+    if (Size <= 32)
+    {
+        _mm_storeu_si128((__m128i*)Dst, Head);
+        _mm_storeu_si128((__m128i*)(Dst + Size - 16), Tail);
+        return Target;
+    }
+
+    if (Size >= MemoryFastStringSize)
+    {
+        __movsb(Dst, Src, Size);
+        return Target;
+    }
+
+    // The first block is stored unaligned, the rest with aligned stores and the tail overlaps the last block
+    _mm_storeu_si128((__m128i*)Dst, Head);
+    auto Offset = 16 - ((uintptr_t)Dst & 15);
+
+    for (; Offset + 64 <= Size; Offset += 64)
+    {
+        auto Block0 = _mm_loadu_si128((const __m128i*)(Src + Offset));
+        auto Block1 = _mm_loadu_si128((const __m128i*)(Src + Offset + 16));
+        auto Block2 = _mm_loadu_si128((const __m128i*)(Src + Offset + 32));
+        auto Block3 = _mm_loadu_si128((const __m128i*)(Src + Offset + 48));
+        _mm_store_si128((__m128i*)(Dst + Offset), Block0);
+        _mm_store_si128((__m128i*)(Dst + Offset + 16), Block1);
+        _mm_store_si128((__m128i*)(Dst + Offset + 32), Block2);
+        _mm_store_si128((__m128i*)(Dst + Offset + 48), Block3);
+    }
+
+    for (; Offset + 16 <= Size; Offset += 16)
+    {
+        _mm_store_si128((__m128i*)(Dst + Offset), _mm_loadu_si128((const __m128i*)(Src + Offset)));
+    }
+
+    _mm_storeu_si128((__m128i*)(Dst + Size - 16), Tail);
+
+    return Target;
+}
+
+void* MemorySet(void* Target, uint8_t Value, size_t Size)
+{
+    auto Dst = (uint8_t*)Target;
+
+    if (Size <= 16)
+    {
+        // Broadcast the byte into every byte of a word
+        auto Word = Value * 0x0101010101010101ull;
+
+        if (Size >= 8)
+        {
+            *(uint64_t*)Dst = Word;
+            *(uint64_t*)(Dst + Size - 8) = Word;
+        }
+        else if (Size >= 4)
+        {
+            *(uint32_t*)Dst = (uint32_t)Word;
+            *(uint32_t*)(Dst + Size - 4) = (uint32_t)Word;
+        }
+        else if (Size >= 2)
+        {
+            *(uint16_t*)Dst = (uint16_t)Word;
+            *(uint16_t*)(Dst + Size - 2) = (uint16_t)Word;
+        }
+        else if (Size == 1)
+        {
+            *Dst = Value;
+        }
+
+        return Target;
+    }
+
+    auto Block = _mm_set1_epi8((char)Value);
+
+    if (Size <= 32)
+    {
+        _mm_storeu_si128((__m128i*)Dst, Block);
+        _mm_storeu_si128((__m128i*)(Dst + Size - 16), Block);
+        return Target;
+    }
+
+    if (Size >= MemoryFastStringSize)
+    {
+        __stosb(Dst, Value, Size);
+        return Target;
+    }
+
+    _mm_storeu_si128((__m128i*)Dst, Block);
+    auto Offset = 16 - ((uintptr_t)Dst & 15);
+
+    for (; Offset + 64 <= Size; Offset += 64)
+    {
+        _mm_store_si128((__m128i*)(Dst + Offset), Block);
+        _mm_store_si128((__m128i*)(Dst + Offset + 16), Block);
+        _mm_store_si128((__m128i*)(Dst + Offset + 32), Block);
+        _mm_store_si128((__m128i*)(Dst + Offset + 48), Block);
+    }
+
+    for (; Offset + 16 <= Size; Offset += 16)
+    {
+        _mm_store_si128((__m128i*)(Dst + Offset), Block);
+    }
+
+    _mm_storeu_si128((__m128i*)(Dst + Size - 16), Block);
+
+    return Target;
+}
+
+static int CompareBlock(const uint8_t* Left, const uint8_t* Right, uint32_t Mask)
+{
+    // Mask has a bit set for every byte that differs
+    unsigned long Bit = 0;
+    _BitScanForward(&Bit, Mask);
+
+    return Left[Bit] - Right[Bit];
+}
+
+int MemoryCompare(const void* Left, const void* Right, size_t Size)
+{
+    auto Lhs = (const uint8_t*)Left;
+    auto Rhs = (const uint8_t*)Right;
+
+    if (Size < 16)
+    {
+        size_t Offset = 0;
+
+        // Two overlapping words cover 8 to 15 bytes, the byte loop finds the difference in the word that differs
+        if (Size >= 8 && *(const uint64_t*)Lhs == *(const uint64_t*)Rhs)
+        {
+            Offset = Size - 8;
+            if (*(const uint64_t*)(Lhs + Offset) == *(const uint64_t*)(Rhs + Offset))
+            {
+                return 0;
+            }
+        }
+
+        for (; Offset < Size; Offset++)
+        {
+            if (Lhs[Offset] != Rhs[Offset])
+            {
+                return Lhs[Offset] - Rhs[Offset];
+            }
+        }
+
+        return 0;
+    }
+
+    size_t Offset = 0;
+    for (; Offset + 16 <= Size; Offset += 16)
+    {
+        auto Equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(Lhs + Offset)), _mm_loadu_si128((const __m128i*)(Rhs + Offset)));
+        auto Mask = (uint32_t)_mm_movemask_epi8(Equal) ^ 0xFFFF;
+        if (Mask != 0)
+        {
+            return CompareBlock(Lhs + Offset, Rhs + Offset, Mask);
+        }
+    }
+
+    // The last block overlaps bytes that are already known to be equal
+    if (Offset < Size)
+    {
+        Offset = Size - 16;
+        auto Equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(Lhs + Offset)), _mm_loadu_si128((const __m128i*)(Rhs + Offset)));
+        auto Mask = (uint32_t)_mm_movemask_epi8(Equal) ^ 0xFFFF;
+        if (Mask != 0)
+        {
+            return CompareBlock(Lhs + Offset, Rhs + Offset, Mask);
+        }
+    }
+
+    return 0;
+}
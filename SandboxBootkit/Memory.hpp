@@ -0,0 +1,11 @@
+#pragma once
+
+#include "Efi.hpp"
+
+// From this size on the bulk paths use rep movsb/stosb (fast strings) instead of SSE stores
+static const size_t MemoryFastStringSize = 2048;
+
+// The implementations of memcpy, memset and memcmp (there is no CRT in the EFI image)
+void* MemoryCopy(void* Target, const void* Source, size_t Size);
+void* MemorySet(void* Target, uint8_t Value, size_t Size);
+int MemoryCompare(const void* Left, const void* Right, size_t Size);
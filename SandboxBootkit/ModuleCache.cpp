@@ -0,0 +1,200 @@
+#include <algorithm>
+
+#include "ModuleCache.hpp"
+#include "Arena.hpp"
+
+// Sorted by base, the ranges do not overlap
+static ModuleRange ModuleRanges[MaxModuleRanges];
+static size_t ModuleRangeCount = 0;
+static bool ModuleCacheInitialized = false;
+
+// Same as the FindImageBase default
+static const size_t MaxImageSearchPages = 1 * 1024 * 1024;
+
+static ModuleRange* LookupModuleRange(uint64_t Address)
+{
+    auto End = ModuleRanges + ModuleRangeCount;
+    auto Found = std::upper_bound(ModuleRanges, End, Address, [](uint64_t Address, const ModuleRange& Range)
+        {
+            return Address < Range.Base;
+        });
+
+    if (Found == ModuleRanges || Address >= (Found - 1)->End)
+    {
+        return nullptr;
+    }
+
+    return Found - 1;
+}
+
+static void RemoveModuleRange(ModuleRange* Range)
+{
+    // Element-wise, there is no memmove without the CRT
+    for (auto Next = Range + 1; Next < ModuleRanges + ModuleRangeCount; Next++)
+    {
+        *(Next - 1) = *Next;
+    }
+
+    ModuleRangeCount--;
+}
+
+static ModuleRange* InsertModuleRange(uint64_t Base, uint64_t End, void* ImageBase)
+{
+    if (Base >= End)
+    {
+        return nullptr;
+    }
+
+    // Pages cached without an image that turn out to belong to this one
+    if (ImageBase != nullptr)
+    {
+        for (size_t i = 0; i < ModuleRangeCount;)
+        {
+            auto Range = &ModuleRanges[i];
+            if (Range->ImageBase == nullptr && Range->Base < End && Range->End > Base)
+            {
+                RemoveModuleRange(Range);
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    auto RangesEnd = ModuleRanges + ModuleRangeCount;
+    auto Position = std::lower_bound(ModuleRanges, RangesEnd, Base, [](const ModuleRange& Range, uint64_t Base)
+        {
+            return Range.Base < Base;
+        });
+
+    // Clip the range against its neighbours
+    if (Position != ModuleRanges && (Position - 1)->End > Base)
+    {
+        Base = (Position - 1)->End;
+    }
+
+    if (Position != RangesEnd && Position->Base < End)
+    {
+        End = Position->Base;
+    }
+
+    // Full, lookups still work through FindImageBase
+    if (Base >= End || ModuleRangeCount == MaxModuleRanges)
+    {
+        return nullptr;
+    }
+
+    for (auto Last = RangesEnd; Last > Position; Last--)
+    {
+        *Last = *(Last - 1);
+    }
+
+    ModuleRangeCount++;
+
+    Position->Base = Base;
+    Position->End = End;
+    Position->ImageBase = ImageBase;
+    Position->Probed = false;
+
+    return Position;
+}
+
+static ModuleRange* InsertImage(void* ImageBase, uint64_t ImageSize)
+{
+    auto NtHeaders = GetNtHeaders(ImageBase);
+    if (NtHeaders != nullptr)
+    {
+        ImageSize = std::max<uint64_t>(ImageSize, NtHeaders->OptionalHeader.SizeOfImage);
+    }
+
+    return InsertModuleRange((uint64_t)ImageBase, (uint64_t)ImageBase + ImageSize, ImageBase);
+}
+
+void InitializeModuleCache()
+{
+    if (ModuleCacheInitialized)
+    {
+        return;
+    }
+
+    ModuleCacheInitialized = true;
+
+    // The handle buffer is only needed here
+    ArenaScope Scope(gTransientArena);
+    size_t Count = 0;
+    EFI_HANDLE* Handles = nullptr;
+    auto Status = EfiLocateHandles(&gEfiLoadedImageProtocolGuid, &Count, &Handles);
+    if (EFI_ERROR(Status))
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < Count; i++)
+    {
+        EFI_LOADED_IMAGE* LoadedImage = nullptr;
+        Status = gBS->HandleProtocol(Handles[i], &gEfiLoadedImageProtocolGuid, (void**)&LoadedImage);
+        if (!EFI_ERROR(Status) && LoadedImage->ImageBase != nullptr && LoadedImage->ImageSize != 0)
+        {
+            InsertImage(LoadedImage->ImageBase, LoadedImage->ImageSize);
+        }
+    }
+}
+
+ModuleRange* FindModule(uint64_t Address, size_t* PagesProbed)
+{
+    if (PagesProbed != nullptr)
+    {
+        *PagesProbed = 0;
+    }
+
+    if (auto Range = LookupModuleRange(Address))
+    {
+        if (Range->ImageBase == nullptr)
+        {
+            return nullptr;
+        }
+
+        // The image might have been unloaded and its memory reused since it was cached
+        if (GetNtHeaders(Range->ImageBase) != nullptr)
+        {
+            return Range;
+        }
+
+        RemoveModuleRange(Range);
+    }
+
+    // Images loaded by the boot manager itself (winload) are not in the loaded image list
+    auto Page = Address & ~(uint64_t)EFI_PAGE_MASK;
+    auto ImageBase = FindImageBase(Address, MaxImageSearchPages);
+    if (ImageBase == nullptr)
+    {
+        if (PagesProbed != nullptr)
+        {
+            *PagesProbed = (size_t)std::min<uint64_t>(Page / EFI_PAGE_SIZE, MaxImageSearchPages);
+        }
+
+        // Only the calling page is remembered, an image can still be loaded below it later
+        InsertModuleRange(Page, Page + EFI_PAGE_SIZE, nullptr);
+
+        return nullptr;
+    }
+
+    if (PagesProbed != nullptr)
+    {
+        *PagesProbed = (size_t)((Page - (uint64_t)ImageBase) / EFI_PAGE_SIZE) + 1;
+    }
+
+    // Not cached when the table is full or the range was clipped, the caller still gets a range
+    // Probed is kept while the same image misses the cache, so the caller does not look at it again
+    static ModuleRange Uncached;
+    auto Range = InsertImage(ImageBase, Page + EFI_PAGE_SIZE - (uint64_t)ImageBase);
+    if (Range == nullptr || Range->ImageBase != ImageBase || Address < Range->Base || Address >= Range->End)
+    {
+        auto Probed = Uncached.ImageBase == ImageBase && Uncached.Probed;
+        Uncached = { (uint64_t)ImageBase, Page + EFI_PAGE_SIZE, ImageBase, Probed };
+        Range = &Uncached;
+    }
+
+    return Range;
+}
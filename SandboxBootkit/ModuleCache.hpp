@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Efi.hpp"
+
+static const size_t MaxModuleRanges = 128;
+
+// Address range of an image, or of pages FindImageBase found no image in (ImageBase is null then)
+struct ModuleRange
+{
+    uint64_t Base;
+    uint64_t End;
+    void* ImageBase;
+    bool Probed; // Set by the caller once it has looked at the module, so it only does that once
+};
+
+// Seeds the cache with every image loaded through boot services (EFI_LOADED_IMAGE_PROTOCOL)
+void InitializeModuleCache();
+
+// Binary search of the cached ranges, misses fall back to FindImageBase and are cached
+// PagesProbed receives the pages FindImageBase had to walk (zero for cached addresses)
+ModuleRange* FindModule(uint64_t Address, size_t* PagesProbed = nullptr);
@@ -0,0 +1,59 @@
+#include "PatchBootmgfw.hpp"
+#include "PatchCache.hpp"
+#include "Trace.hpp"
+
+constexpr PatchEntry BootmgfwPatches[] = {
+    /*
+    bootmgfw!BmFwVerifySelfIntegrity
+    .text:000000001002AE5C 89 4C 24 08           mov     [rsp-30h+arg_0], ecx
+    .text:000000001002AE60 55                    push    rbp
+    .text:000000001002AE61 53                    push    rbx
+    .text:000000001002AE62 56                    push    rsi
+    .text:000000001002AE63 57                    push    rdi
+    .text:000000001002AE64 41 55                 push    r13
+    .text:000000001002AE66 41 56                 push    r14
+    .text:000000001002AE68 48 8B EC              mov     rbp, rsp
+    .text:000000001002AE6B 48 83 EC 68           sub     rsp, 68h
+    .text:000000001002AE6F 48 8B 05 FA 71 13 00  mov     rax, cs:BootDevice
+    .text:000000001002AE76 33 FF                 xor     edi, edi
+    .text:000000001002AE78 48 83 65 C8 00        and     qword ptr [rbp+Device.Type], 0
+    .text:000000001002AE7D 48 83 65 48 00        and     [rbp+arg_10], 0
+    We try to find this:
+    .text:000000001002AE82 83 4D 38 FF           or      [rbp+arg_0], 0FFFFFFFFh
+    .text:000000001002AE86 83 4D 40 FF           or      [rbp+a1], 0FFFFFFFFh
+    */
+    {
+        "BmFwVerifySelfIntegrity",
+        nullptr,
+        MakeSignature("83 4D ?? FF 83 4D ?? FF"),
+        0,
+        PATCH_BYTES("\x33\xC0\xC3"), // xor eax, eax; ret
+        0,
+        0,
+        PatchFunctionStart,
+    },
+};
+
+const size_t BootmgfwPatchCount = ARRAY_SIZE(BootmgfwPatches);
+
+void PatchSelfIntegrity(void* ImageBase, uint64_t ImageSize)
+{
+    auto TraceStart = TraceBegin();
+    PeImage Image(ImageBase, ImageSize);
+
+    // Use the sites resolved by the Injector if they still match, otherwise scan
+    uint8_t* Sites[MaxPatchSites] = {};
+    if (!LoadPatchCacheEntry(PatchCacheBootmgfw, ImageBase, ImageSize, BootmgfwPatches, BootmgfwPatchCount, Sites) ||
+        !ValidatePatchSites(BootmgfwPatches, BootmgfwPatchCount, Sites))
+    {
+        ASSERT(FindPatchSites(Image, BootmgfwPatches, BootmgfwPatchCount, Sites));
+    }
+    else
+    {
+        TraceCount(TracePatchCacheHits);
+    }
+
+    ASSERT(ApplyPatches(Image, BootmgfwPatches, BootmgfwPatchCount, Sites));
+
+    TraceEnd(TracePatchSelfIntegrity, TraceStart);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "Efi.hpp"
+#include "PatchEngine.hpp"
+
+extern const PatchEntry BootmgfwPatches[];
+extern const size_t BootmgfwPatchCount;
+
+void PatchSelfIntegrity(void* ImageBase, uint64_t ImageSize);
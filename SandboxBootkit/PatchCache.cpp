@@ -0,0 +1,138 @@
+#include <algorithm>
+
+#include "PatchCache.hpp"
+#include "Efi.hpp"
+#include "PatchBootmgfw.hpp"
+#include "PatchNtoskrnl.hpp"
+
+static const PatchCache* ActivePatchCache = nullptr;
+
+void SetPatchCache(const PatchCache* Cache)
+{
+    // Tables written by a different Injector version are ignored
+    if (Cache != nullptr && (Cache->Magic != PatchCacheMagic || Cache->Version != PatchCacheVersion))
+    {
+        Cache = nullptr;
+    }
+
+    ActivePatchCache = Cache;
+}
+
+bool LoadPatchCacheEntry(PatchCacheImage Image, void* ImageBase, uint64_t ImageSize, const PatchEntry* Entries, size_t Count, uint8_t** Sites)
+{
+    if (ActivePatchCache == nullptr || Image >= PatchCacheImageCount)
+    {
+        return false;
+    }
+
+    auto NtHeaders = GetNtHeaders(ImageBase);
+    if (NtHeaders == nullptr)
+    {
+        return false;
+    }
+
+    auto& Entry = ActivePatchCache->Entries[Image];
+    auto SiteCount = GetPatchSiteCount(Entries, Count);
+    if (Entry.SiteCount != SiteCount || SiteCount > PatchCacheMaxSites ||
+        Entry.TimeDateStamp != NtHeaders->FileHeader.TimeDateStamp ||
+        Entry.SizeOfImage != NtHeaders->OptionalHeader.SizeOfImage ||
+        (Entry.CheckSum != 0 && Entry.CheckSum != NtHeaders->OptionalHeader.CheckSum))
+    {
+        return false;
+    }
+
+    // The signature is compared at the match, the bytes are written at match + Offset and every caller is checked for a call rel32
+    auto Site = Entry.SiteRvas;
+    for (size_t i = 0; i < Count; i++)
+    {
+        auto& Patch = Entries[i];
+        auto PatchRva = (int64_t)Site[0] + Patch.Offset;
+        if ((uint64_t)Site[0] + Patch.Pattern.Length > ImageSize || PatchRva < 0 || (uint64_t)PatchRva + Patch.ByteCount > ImageSize)
+        {
+            return false;
+        }
+
+        auto EntrySiteCount = GetPatchSiteCount(&Patch, 1);
+        for (size_t j = 1; j < EntrySiteCount; j++)
+        {
+            if ((uint64_t)Site[j] + 5 > ImageSize)
+            {
+                return false;
+            }
+        }
+
+        for (size_t j = 0; j < EntrySiteCount; j++)
+        {
+            Sites[j] = RVA<uint8_t*>(ImageBase, Site[j]);
+        }
+
+        Site += EntrySiteCount;
+        Sites += EntrySiteCount;
+    }
+
+    return true;
+}
+
+bool ResolvePatchCacheEntry(PatchCacheImage Image, const void* FileData, size_t FileSize, PatchCacheEntry& Entry, uint64_t ScanSize)
+{
+    auto SizeOfImage = GetImageFileSize(FileData, FileSize);
+    if (SizeOfImage == 0)
+    {
+        return false;
+    }
+
+    EFI_PHYSICAL_ADDRESS Address = 0;
+    if (EFI_ERROR(gBS->AllocatePages(AllocateAnyPages, EfiBootServicesData, EFI_SIZE_TO_PAGES(SizeOfImage), &Address)))
+    {
+        return false;
+    }
+
+    auto ImageBase = (void*)Address;
+    uint8_t* Sites[MaxPatchSites] = {};
+    const PatchEntry* Entries = nullptr;
+    size_t Count = 0;
+    auto Resolved = false;
+
+    switch (Image)
+    {
+    case PatchCacheBootmgfw:
+        Entries = BootmgfwPatches;
+        Count = BootmgfwPatchCount;
+        break;
+
+    case PatchCacheNtoskrnl:
+        Entries = NtoskrnlPatches;
+        Count = NtoskrnlPatchCount;
+        break;
+
+    default:
+        break;
+    }
+
+    auto SiteCount = GetPatchSiteCount(Entries, Count);
+    if (Entries != nullptr && SiteCount <= PatchCacheMaxSites && MapImageFile(FileData, FileSize, ImageBase, SizeOfImage))
+    {
+        auto ResolveSize = ScanSize != 0 ? std::min<uint64_t>(ScanSize, SizeOfImage) : SizeOfImage;
+        Resolved = InitializePatchEngine() && FindPatchSites(PeImage(ImageBase, ResolveSize), Entries, Count, Sites);
+    }
+
+    if (Resolved)
+    {
+        auto NtHeaders = GetNtHeaders(ImageBase);
+
+        Entry = {};
+        Entry.TimeDateStamp = NtHeaders->FileHeader.TimeDateStamp;
+        Entry.SizeOfImage = NtHeaders->OptionalHeader.SizeOfImage;
+        Entry.CheckSum = NtHeaders->OptionalHeader.CheckSum;
+        Entry.SiteCount = (uint32_t)SiteCount;
+
+        for (size_t i = 0; i < SiteCount; i++)
+        {
+            Entry.SiteRvas[i] = (uint32_t)(Sites[i] - (uint8_t*)ImageBase);
+        }
+    }
+
+    gBS->FreePages(Address, EFI_SIZE_TO_PAGES(SizeOfImage));
+
+    return Resolved;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+// Shared with the Injector, keep this header free of EFI types
+#include <cstddef>
+#include <cstdint>
+
+// Patch sites resolved offline by the Injector, stored in the padding page in front of the bootkit image
+static const uint32_t PatchCacheMagic = 0x48435042; // 'BPCH'
+static const uint32_t PatchCacheVersion = 1;
+static const size_t PatchCacheMaxSites = 16;
+static const size_t PatchCacheOffset = 0x1000; // Distance from the start of the cache to the bootkit image
+
+enum PatchCacheImage : uint32_t
+{
+    PatchCacheBootmgfw,
+    PatchCacheNtoskrnl,
+    PatchCacheImageCount,
+};
+
+struct PatchCacheEntry
+{
+    // Headers of the image the sites were resolved for (a CheckSum of zero is not compared)
+    uint32_t TimeDateStamp;
+    uint32_t SizeOfImage;
+    uint32_t CheckSum;
+
+    // Zero if the image was not resolved
+    uint32_t SiteCount;
+    uint32_t SiteRvas[PatchCacheMaxSites];
+};
+
+struct PatchCache
+{
+    uint32_t Magic;
+    uint32_t Version;
+    PatchCacheEntry Entries[PatchCacheImageCount];
+};
+
+static_assert(sizeof(PatchCache) <= PatchCacheOffset, "PatchCache does not fit in front of the bootkit image");
+
+struct PatchEntry;
+
+// Boot: only a cache with the current magic and version is used
+void SetPatchCache(const PatchCache* Cache);
+
+// Sites are only loaded when everything the validation reads and the patches write is within ImageSize
+bool LoadPatchCacheEntry(PatchCacheImage Image, void* ImageBase, uint64_t ImageSize, const PatchEntry* Entries, size_t Count, uint8_t** Sites);
+
+// Injector: maps the image file and resolves its patch sites
+// A non-zero ScanSize only resolves the start of the image, like the boot code that scans bootmgfw without .bootkit
+bool ResolvePatchCacheEntry(PatchCacheImage Image, const void* FileData, size_t FileSize, PatchCacheEntry& Entry, uint64_t ScanSize = 0);
@@ -0,0 +1,333 @@
+#include <algorithm>
+
+#include "PatchEngine.hpp"
+#include "Trace.hpp"
+#include "XrefIndex.hpp"
+
+// Allocated up front, there are no boot services in winload's application context
+static BOOTKIT_THREAD_LOCAL void* XrefStorage = nullptr;
+
+bool InitializePatchEngine()
+{
+    if (XrefStorage != nullptr)
+    {
+        return true;
+    }
+
+    EFI_PHYSICAL_ADDRESS Address = 0;
+    auto Status = gBS->AllocatePages(AllocateAnyPages, EfiBootServicesData, EFI_SIZE_TO_PAGES(XrefStorageSize), &Address);
+    if (EFI_ERROR(Status))
+    {
+        return false;
+    }
+
+    XrefStorage = (void*)Address;
+
+    return true;
+}
+
+void ShutdownPatchEngine()
+{
+    if (XrefStorage == nullptr)
+    {
+        return;
+    }
+
+    gBS->FreePages((EFI_PHYSICAL_ADDRESS)XrefStorage, EFI_SIZE_TO_PAGES(XrefStorageSize));
+    XrefStorage = nullptr;
+}
+
+static size_t GetEntrySiteCount(const PatchEntry& Entry)
+{
+    return 1 + (Entry.Action == PatchCallers ? Entry.ExpectedCallers : 0);
+}
+
+size_t GetPatchSiteCount(const PatchEntry* Entries, size_t Count)
+{
+    size_t SiteCount = 0;
+    for (size_t i = 0; i < Count; i++)
+    {
+        SiteCount += GetEntrySiteCount(Entries[i]);
+    }
+
+    return SiteCount;
+}
+
+static bool IsSameSection(const char* SectionName, const char* OtherSectionName)
+{
+    if (SectionName == nullptr || OtherSectionName == nullptr)
+    {
+        return SectionName == OtherSectionName;
+    }
+
+    return strcmp(SectionName, OtherSectionName) == 0;
+}
+
+// Clamped to the image, a section that starts outside of it is treated as missing
+static bool GetSectionRange(const PeImage& Image, EFI_IMAGE_SECTION_HEADER* Section, uint8_t** Base, size_t* Size)
+{
+    if (Section == nullptr || Section->VirtualAddress >= Image.Size)
+    {
+        return false;
+    }
+
+    *Base = RVA<uint8_t*>(Image.Base, Section->VirtualAddress);
+    *Size = (size_t)std::min<uint64_t>(Section->Misc.VirtualSize, Image.Size - Section->VirtualAddress);
+
+    return true;
+}
+
+static bool IsCallTo(uint8_t* Address, uint8_t* Target)
+{
+    // call rel32
+    return Address[0] == 0xE8 && Address + 5 + *(int32_t*)(Address + 1) == Target;
+}
+
+// Checks the match and caller counts of one entry and fills its sites, the xref index is kept for the next entry of the section
+static void EvaluatePatchEntry(const PeImage& Image, const PatchEntry& Entry, const PatternScan& Scan, uint8_t* Base, size_t Size,
+    XrefIndex& Xrefs, uint8_t** XrefsBase, uint8_t** EntrySites, PatchSiteResult& Result)
+{
+    Result.Match = Scan.Match;
+    Result.MatchCount = Scan.MatchCount;
+
+    if (Scan.Match == nullptr || (Entry.ExpectedMatches != 0 && Scan.MatchCount != Entry.ExpectedMatches))
+    {
+        Result.Status = PatchSiteMatchCount;
+        return;
+    }
+
+    EntrySites[0] = Scan.Match;
+
+    if (Entry.Action == PatchCallers)
+    {
+        // The callers are looked up in the section of the match
+        auto SectionBase = Base;
+        auto SectionSize = Size;
+        if (Entry.SectionName == nullptr && !GetSectionRange(Image, Image.FindSection(EntrySites[0], SectionExecutable), &SectionBase, &SectionSize))
+        {
+            Result.Status = PatchSiteMissingSection;
+            return;
+        }
+
+        if (*XrefsBase != SectionBase)
+        {
+            auto TraceStart = TraceBegin();
+            *XrefsBase = nullptr;
+            if (XrefStorage == nullptr || !BuildXrefIndex(Xrefs, Image.Base, SectionBase, SectionSize, XrefStorage, XrefStorageSize))
+            {
+                Result.Status = PatchSiteXrefOverflow;
+                return;
+            }
+
+            TraceEnd(TraceBuildXrefIndex, TraceStart, 0, SectionSize);
+            *XrefsBase = SectionBase;
+        }
+
+        // Every caller is counted, only the expected number is stored
+        auto Target = EntrySites[0] + Entry.Offset;
+        Result.CallerCount = FindCallers(Xrefs, Target, &EntrySites[1], Entry.ExpectedCallers);
+        if (Entry.ExpectedCallers == 0 || Result.CallerCount != Entry.ExpectedCallers)
+        {
+            Result.Status = PatchSiteCallerCount;
+            return;
+        }
+    }
+
+    Result.Status = PatchSiteFound;
+}
+
+bool FindPatchSites(const PeImage& Image, const PatchEntry* Entries, size_t Count, uint8_t** Sites, PatchSiteResult* Results)
+{
+    if (Count > MaxPatchEntries || GetPatchSiteCount(Entries, Count) > MaxPatchSites)
+    {
+        return false;
+    }
+
+    // Index of the first site of every entry
+    size_t SiteIndex[MaxPatchEntries] = {};
+    for (size_t i = 1; i < Count; i++)
+    {
+        SiteIndex[i] = SiteIndex[i - 1] + GetEntrySiteCount(Entries[i - 1]);
+    }
+
+    auto AllFound = true;
+    bool Scanned[MaxPatchEntries] = {};
+    for (size_t i = 0; i < Count; i++)
+    {
+        if (Scanned[i])
+        {
+            continue;
+        }
+
+        // Batch the remaining entries of this section into a single sweep
+        size_t Batch[MaxPatternScans] = {};
+        PatternScan Scans[MaxPatternScans] = {};
+        size_t BatchCount = 0;
+        for (size_t j = i; j < Count && BatchCount < MaxPatternScans; j++)
+        {
+            if (!Scanned[j] && IsSameSection(Entries[i].SectionName, Entries[j].SectionName))
+            {
+                Scanned[j] = true;
+                Batch[BatchCount] = j;
+                Scans[BatchCount] = SignatureScan(Entries[j].Pattern);
+                BatchCount++;
+            }
+        }
+
+        // Named entries only scan their section (some sections are NOACCESS), the others every section that can hold code
+        uint8_t* Base = nullptr;
+        size_t Size = 0;
+        if (Entries[i].SectionName != nullptr && !GetSectionRange(Image, Image.FindSection(Entries[i].SectionName), &Base, &Size))
+        {
+            if (Results == nullptr)
+            {
+                return false;
+            }
+
+            for (size_t k = 0; k < BatchCount; k++)
+            {
+                Results[Batch[k]] = {};
+                Results[Batch[k]].Status = PatchSiteMissingSection;
+            }
+
+            AllFound = false;
+            continue;
+        }
+
+        auto TraceStart = TraceBegin();
+        if (Entries[i].SectionName != nullptr)
+        {
+            FindPatterns(Base, Size, Scans, BatchCount);
+        }
+        else
+        {
+            Size = Image.FindPatternsInSections(SectionExecutable, Scans, BatchCount);
+        }
+        auto TraceCycles = TraceBegin() - TraceStart;
+        TraceCount(TraceBytesScanned, Size);
+
+        for (size_t k = 0; k < BatchCount; k++)
+        {
+            TraceWrite(TraceSignatureScan, TraceStart, TraceCycles, Batch[k], Size);
+        }
+
+        XrefIndex Xrefs = {};
+        uint8_t* XrefsBase = nullptr;
+        for (size_t k = 0; k < BatchCount; k++)
+        {
+            PatchSiteResult Result = {};
+            EvaluatePatchEntry(Image, Entries[Batch[k]], Scans[k], Base, Size, Xrefs, &XrefsBase, &Sites[SiteIndex[Batch[k]]], Result);
+
+            if (Results != nullptr)
+            {
+                Results[Batch[k]] = Result;
+            }
+            else if (Result.Status != PatchSiteFound)
+            {
+                return false;
+            }
+
+            AllFound = AllFound && Result.Status == PatchSiteFound;
+        }
+    }
+
+    return AllFound;
+}
+
+bool ValidatePatchSites(const PatchEntry* Entries, size_t Count, uint8_t** Sites)
+{
+    for (size_t i = 0; i < Count; i++)
+    {
+        auto& Entry = Entries[i];
+        auto Match = Sites[0];
+
+        if (Match == nullptr || !ComparePattern(Match, SignatureScan(Entry.Pattern)))
+        {
+            return false;
+        }
+
+        if (Entry.Action == PatchCallers)
+        {
+            for (size_t j = 1; j <= Entry.ExpectedCallers; j++)
+            {
+                if (Sites[j] == nullptr || !IsCallTo(Sites[j], Match + Entry.Offset))
+                {
+                    return false;
+                }
+            }
+        }
+
+        Sites += GetEntrySiteCount(Entry);
+    }
+
+    return true;
+}
+
+size_t GetPatchTargets(const PeImage& Image, const PatchEntry& Entry, uint8_t** Sites, uint8_t** Targets)
+{
+    auto Match = Sites[0] + Entry.Offset;
+
+    switch (Entry.Action)
+    {
+    case PatchWriteBytes:
+        Targets[0] = Match;
+        return 1;
+
+    case PatchFunctionStart:
+        Targets[0] = Image.FindFunctionStart(Match);
+        return 1;
+
+    case PatchCallers:
+        for (size_t j = 1; j <= Entry.ExpectedCallers; j++)
+        {
+            Targets[j - 1] = Image.FindFunctionStart(Sites[j]);
+        }
+        return Entry.ExpectedCallers;
+    }
+
+    return 0;
+}
+
+bool ApplyPatches(const PeImage& Image, const PatchEntry* Entries, size_t Count, uint8_t** Sites)
+{
+    if (GetPatchSiteCount(Entries, Count) > MaxPatchSites)
+    {
+        return false;
+    }
+
+    auto TraceStart = TraceBegin();
+
+    // Resolve every target before the first write
+    uint8_t* Targets[MaxPatchSites] = {};
+    const PatchEntry* TargetEntries[MaxPatchSites] = {};
+    size_t TargetCount = 0;
+
+    for (size_t i = 0; i < Count; i++)
+    {
+        auto& Entry = Entries[i];
+        auto EntryTargetCount = GetPatchTargets(Image, Entry, Sites, &Targets[TargetCount]);
+        for (size_t j = 0; j < EntryTargetCount; j++)
+        {
+            TargetEntries[TargetCount++] = &Entry;
+        }
+
+        Sites += GetEntrySiteCount(Entry);
+    }
+
+    for (size_t i = 0; i < TargetCount; i++)
+    {
+        if (Targets[i] == nullptr)
+        {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < TargetCount; i++)
+    {
+        memcpy(Targets[i], TargetEntries[i]->Bytes, TargetEntries[i]->ByteCount);
+    }
+
+    TraceEnd(TraceApplyPatches, TraceStart, 0, TargetCount);
+
+    return true;
+}
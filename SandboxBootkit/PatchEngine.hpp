@@ -0,0 +1,70 @@
+#pragma once
+
+#include "Efi.hpp"
+#include "Signature.hpp"
+
+static const size_t MaxPatchEntries = 32;
+static const size_t MaxPatchSites = 32;
+
+enum PatchAction : uint8_t
+{
+    PatchWriteBytes,    // Write the bytes at the match + Offset
+    PatchFunctionStart, // Write the bytes at the start of the function (from .pdata) containing the match + Offset
+    PatchCallers,       // Write the bytes at the start of every function that calls the match + Offset
+};
+
+struct PatchEntry
+{
+    const char* Name;
+    const char* SectionName; // nullptr scans every executable section
+    Signature Pattern;
+    int32_t Offset;
+    const char* Bytes;
+    uint8_t ByteCount;
+    uint8_t ExpectedMatches; // Number of matches in the section, 0 uses the first match without checking
+    uint8_t ExpectedCallers; // PatchCallers only, has to be set
+    PatchAction Action;
+};
+
+enum PatchSiteStatus : uint8_t
+{
+    PatchSiteFound,
+    PatchSiteMissingSection, // The named section (or the section of a whole image match) is not in the image
+    PatchSiteMatchCount,     // No match, or not ExpectedMatches of them
+    PatchSiteXrefOverflow,   // The section has more references than the xref storage holds
+    PatchSiteCallerCount,    // Not ExpectedCallers callers
+};
+
+// Outcome of one entry, filled as far as the entry got
+struct PatchSiteResult
+{
+    PatchSiteStatus Status;
+    uint8_t* Match;
+    size_t MatchCount;
+    size_t CallerCount; // PatchCallers only, includes the callers beyond ExpectedCallers
+};
+
+// Replacement bytes from a string literal
+#define PATCH_BYTES(Bytes) Bytes, uint8_t(sizeof(Bytes) - 1)
+
+// Every entry resolves to one site (its match), PatchCallers entries are followed by a site per caller
+size_t GetPatchSiteCount(const PatchEntry* Entries, size_t Count);
+
+// Storage for the caller lookups, has to be allocated while boot services are available
+bool InitializePatchEngine();
+
+// Frees the storage of the calling thread, the host tools call it before a worker thread exits (the bootkit keeps it)
+void ShutdownPatchEngine();
+
+// Scans every section once for all of its entries and checks the match and caller counts
+// Stops at the first failure, unless Results (one per entry) is given to report every entry
+bool FindPatchSites(const PeImage& Image, const PatchEntry* Entries, size_t Count, uint8_t** Sites, PatchSiteResult* Results = nullptr);
+
+// Cheap check of previously resolved sites (signature compare at every match, call check at every caller)
+bool ValidatePatchSites(const PatchEntry* Entries, size_t Count, uint8_t** Sites);
+
+// Addresses the entry writes its bytes to (one per caller for PatchCallers), null if a function start is not found
+size_t GetPatchTargets(const PeImage& Image, const PatchEntry& Entry, uint8_t** Sites, uint8_t** Targets);
+
+// Writes every patch, nothing is written unless all patch targets can be resolved
+bool ApplyPatches(const PeImage& Image, const PatchEntry* Entries, size_t Count, uint8_t** Sites);
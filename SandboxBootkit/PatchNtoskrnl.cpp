@@ -1,25 +1,10 @@
 #include "PatchNtoskrnl.hpp"
+#include "PatchCache.hpp"
+#include "Trace.hpp"
 
-void PatchReturn0(void* Function)
-{
-    memcpy(Function, "\x33\xC0\xC3", 3); // xor eax, eax; ret
-}
-
-static void DisablePatchGuard(void* ImageBase, uint64_t ImageSize)
-{
-    // Find the section ranges because some sections are NOACCESS
-    auto InitSection = FindSection(ImageBase, "INIT");
-    ASSERT(InitSection != nullptr);
-
-    auto InitBase = RVA<uint8_t*>(ImageBase, InitSection->VirtualAddress);
-    auto InitSize = InitSection->Misc.VirtualSize;
-
-    auto TextSection = FindSection(ImageBase, ".text");
-    ASSERT(TextSection != nullptr);
-
-    auto TextBase = RVA<uint8_t*>(ImageBase, TextSection->VirtualAddress);
-    auto TextSize = TextSection->Misc.VirtualSize;
-
+// Many of these patches come from EfiGuard:
+// https://github.com/Mattiwatti/EfiGuard/blob/25bb182026d24944713e36f129a93d08397de913/EfiGuardDxe/PatchNtoskrnl.c
+constexpr PatchEntry NtoskrnlPatches[] = {
     /*
     nt!KiInitPGContextCaller
     INIT:0000000140A359E0 40 53                  push    rbx
@@ -32,12 +17,19 @@ static void DisablePatchGuard(void* ImageBase, uint64_t ImageSize)
     INIT:0000000140A359F7 8B 09                  mov     ecx, [rcx]
     INIT:0000000140A359F9 89 44 24 20            mov     [rsp+38h+var_18], eax
     INIT:0000000140A359FD E8 E2 54 FE FF         call    KiInitPGContext
-    */
-    auto KiInitPGContextCaller = FIND_PATTERN(InitBase, InitSize, "\x40\x53\x48\x83\xEC\x30\x8B\x41\x18");
-    ASSERT(KiInitPGContextCaller != nullptr);
 
-    // Force KiInitPGContext to return successful (this is the new patch)
-    memcpy(RVA<void*>(KiInitPGContextCaller, 29), "\xB0\x01\x90\x90\x90", 5); // mov al, 1; nop x3
+    Force KiInitPGContext to return successful (this is the new patch)
+    */
+    {
+        "KiInitPGContextCaller",
+        "INIT",
+        MakeSignature("40 53 48 83 EC 30 8B 41 18"),
+        29,
+        PATCH_BYTES("\xB0\x01\x90\x90\x90"), // mov al, 1; nop x3
+        0,
+        0,
+        PatchWriteBytes,
+    },
 
     /*
     nt!KiSwInterrupt
@@ -45,12 +37,19 @@ static void DisablePatchGuard(void* ImageBase, uint64_t ImageSize)
     .text:00000001403FD24F 48 8D 4D 80           lea     rcx, [rbp+0E8h+var_168]
     .text:00000001403FD253 E8 E8 C2 FD FF        call    KiSwInterruptDispatch
     .text:00000001403FD258 FA                    cli
-    */
-    auto KiSwInterruptDispatchCall = FIND_PATTERN(TextBase, TextSize, "\xFB\x48\x8D\xCC\xCC\xE8\xCC\xCC\xCC\xCC\xFA");
-    ASSERT(KiSwInterruptDispatchCall != nullptr);
 
-    // Prevent KiSwInterruptDispatch from being executed
-    memset(KiSwInterruptDispatchCall, 0x90, 11); // nop x11
+    Prevent KiSwInterruptDispatch from being executed
+    */
+    {
+        "KiSwInterruptDispatchCall",
+        ".text",
+        MakeSignature("FB 48 8D ?? ?? E8 ?? ?? ?? ?? FA"),
+        0,
+        PATCH_BYTES("\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90"), // nop x11
+        0,
+        0,
+        PatchWriteBytes,
+    },
 
     /*
     nt!KiMcaDeferredRecoveryService
@@ -59,57 +58,38 @@ static void DisablePatchGuard(void* ImageBase, uint64_t ImageSize)
     .text:00000001401CCA34 8B F8                                         mov     edi, eax
     .text:00000001401CCA36 8B E8                                         mov     ebp, eax
     .text:00000001401CCA38 4C 8B D0                                      mov     r10, rax
-    */
-    auto KiMcaDeferredRecoveryService = FIND_PATTERN(TextBase, TextSize, "\x33\xC0\x8B\xD8\x8B\xF8\x8B\xE8\x4C\x8B\xD0");
-    ASSERT(KiMcaDeferredRecoveryService != nullptr);
 
-    // Find the callers of this function
-    int CallerCount = 0;
-    for (size_t i = 0, Count = 0; i + 5 < TextSize; i++)
+    Patch out the caller functions at the start (there should not be more than two callers)
+    */
     {
-        auto Address = TextBase + i;
-        if (*Address == 0xE8) // call disp32
-        {
-            auto Displacement = *(int32_t*)(Address + 1);
-            auto CallDestination = Address + Displacement + 5;
-            if (CallDestination == KiMcaDeferredRecoveryService)
-            {
-                // Skip over the call
-                i += 4;
-
-                // There should not be more than two callers
-                CallerCount++;
-
-                // Patch out the caller functions at the start
-                auto CallerFunction = FindFunctionStart(ImageBase, Address);
-                ASSERT(CallerFunction != nullptr);
-
-                PatchReturn0(CallerFunction);
-            }
-        }
-    }
-    ASSERT(CallerCount == 2);
-}
-
-static void DisableDSE(void* ImageBase, uint64_t ImageSize)
-{
-    auto PageSection = FindSection(ImageBase, "PAGE");
-    ASSERT(PageSection != nullptr);
-
-    auto PageBase = RVA<uint8_t*>(ImageBase, PageSection->VirtualAddress);
-    auto PageSize = PageSection->Misc.VirtualSize;
+        "KiMcaDeferredRecoveryService",
+        ".text",
+        MakeSignature("33 C0 8B D8 8B F8 8B E8 4C 8B D0"),
+        0,
+        PATCH_BYTES("\x33\xC0\xC3"), // xor eax, eax; ret
+        0,
+        2,
+        PatchCallers,
+    },
 
     /*
     nt!SepInitializeCodeIntegrity
     PAGE:0000000140799EBB 4C 8D 05 DE 39 48 00   lea     r8, SeCiCallbacks
     PAGE:0000000140799EC2 8B CF                  mov     ecx, edi
     PAGE:0000000140799EC4 48 FF 15 95 71 99 FF   call    cs:__imp_CiInitialize
-    */
-    auto CiInitializeCall = FIND_PATTERN(PageBase, PageSize, "\x4C\x8D\x05\xCC\xCC\xCC\xCC\x8B\xCF");
-    ASSERT(CiInitializeCall != nullptr);
 
-    // Change CodeIntegrityOptions to zero for CiInitialize call
-    *RVA<uint16_t*>(CiInitializeCall, 7) = 0xC931; // xor ecx, ecx
+    Change CodeIntegrityOptions to zero for CiInitialize call
+    */
+    {
+        "CiInitializeCall",
+        "PAGE",
+        MakeSignature("4C 8D 05 ?? ?? ?? ?? 8B CF"),
+        7,
+        PATCH_BYTES("\x31\xC9"), // xor ecx, ecx
+        0,
+        0,
+        PatchWriteBytes,
+    },
 
     /*
     nt!SeValidateImageData
@@ -121,12 +101,19 @@ static void DisableDSE(void* ImageBase, uint64_t ImageSize)
     PAGE:00000001406EBD1B B8 28 04 00 C0         mov     eax, 0C0000428h
     PAGE:00000001406EBD20 EB F3                  jmp     short loc_1406EBD15
     PAGE:00000001406EBD20                  SeValidateImageData endp
-    */
-    auto SeValidateImageDataRet = FIND_PATTERN(PageBase, PageSize, "\x48\x83\xC4\x48\xC3\xCC\xB8\x28\x04\x00\xC0");
-    ASSERT(SeValidateImageDataRet != nullptr);
 
-    // Ensure SeValidateImageData returns a success status
-    *RVA<uint32_t*>(SeValidateImageDataRet, 7) = 0; // mov eax, 0
+    Ensure SeValidateImageData returns a success status
+    */
+    {
+        "SeValidateImageDataRet",
+        "PAGE",
+        MakeSignature("48 83 C4 48 C3 CC B8 28 04 00 C0"),
+        7,
+        PATCH_BYTES("\x00\x00\x00\x00"), // mov eax, 0
+        0,
+        0,
+        PatchWriteBytes,
+    },
 
     /*
     nt!SeCodeIntegrityQueryInformation
@@ -136,22 +123,44 @@ static void DisableDSE(void* ImageBase, uint64_t ImageSize)
     PAGE:00000001406FFB3F 4C 8B D1                                mov     r10, rcx
     PAGE:00000001406FFB42 74 2F                                   jz      short loc_1406FFB73
     */
-    auto SeCodeIntegrityQueryInformation = FIND_PATTERN(PageBase, PageSize, "\x48\x83\xEC\xCC\x48\x83\x3D\xCC\xCC\xCC\xCC\x00\x4D\x8B\xC8\x4C\x8B\xD1\x74");
-    ASSERT(SeCodeIntegrityQueryInformation != nullptr);
-
-    /*
-    mov dword ptr [r8], 8
-    xor eax, eax
-    mov dword ptr [rcx+4], 1
-    ret
-    */
-    memcpy(SeCodeIntegrityQueryInformation, "\x41\xC7\x00\x08\x00\x00\x00\x33\xC0\xC7\x41\x04\x01\x00\x00\x00\xC3", 17);
-}
+    {
+        "SeCodeIntegrityQueryInformation",
+        "PAGE",
+        MakeSignature("48 83 EC ?? 48 83 3D ?? ?? ?? ?? 00 4D 8B C8 4C 8B D1 74"),
+        0,
+        /*
+        mov dword ptr [r8], 8
+        xor eax, eax
+        mov dword ptr [rcx+4], 1
+        ret
+        */
+        PATCH_BYTES("\x41\xC7\x00\x08\x00\x00\x00\x33\xC0\xC7\x41\x04\x01\x00\x00\x00\xC3"),
+        0,
+        0,
+        PatchWriteBytes,
+    },
+};
+
+const size_t NtoskrnlPatchCount = ARRAY_SIZE(NtoskrnlPatches);
 
 void PatchNtoskrnl(void* ImageBase, uint64_t ImageSize)
 {
-    // Many of these patches come from EfiGuard:
-    // https://github.com/Mattiwatti/EfiGuard/blob/25bb182026d24944713e36f129a93d08397de913/EfiGuardDxe/PatchNtoskrnl.c
-    DisablePatchGuard(ImageBase, ImageSize);
-    DisableDSE(ImageBase, ImageSize);
+    auto TraceStart = TraceBegin();
+    PeImage Image(ImageBase, ImageSize);
+
+    // Use the sites resolved by the Injector if they still match this kernel, otherwise scan
+    uint8_t* Sites[MaxPatchSites] = {};
+    if (!LoadPatchCacheEntry(PatchCacheNtoskrnl, ImageBase, ImageSize, NtoskrnlPatches, NtoskrnlPatchCount, Sites) ||
+        !ValidatePatchSites(NtoskrnlPatches, NtoskrnlPatchCount, Sites))
+    {
+        ASSERT(FindPatchSites(Image, NtoskrnlPatches, NtoskrnlPatchCount, Sites));
+    }
+    else
+    {
+        TraceCount(TracePatchCacheHits);
+    }
+
+    ASSERT(ApplyPatches(Image, NtoskrnlPatches, NtoskrnlPatchCount, Sites));
+
+    TraceEnd(TracePatchNtoskrnl, TraceStart);
 }
\ No newline at end of file
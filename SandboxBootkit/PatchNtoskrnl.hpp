@@ -1,6 +1,9 @@
 #pragma once
 
 #include "Efi.hpp"
+#include "PatchEngine.hpp"
+
+extern const PatchEntry NtoskrnlPatches[];
+extern const size_t NtoskrnlPatchCount;
 
-void PatchReturn0(void* Function);
 void PatchNtoskrnl(void* ImageBase, uint64_t ImageSize);
\ No newline at end of file
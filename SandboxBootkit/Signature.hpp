@@ -0,0 +1,148 @@
+#pragma once
+
+#include "Efi.hpp"
+
+// Frequency rank of every byte value in x64 code (0: rarest, 255: most common)
+// Measured over the .text of MSVC and GCC compiled x64 binaries
+static constexpr uint8_t X64ByteRank[256] = {
+    255, 245, 227, 214, 224, 223, 170, 192, 238, 168, 188, 171, 198, 200, 123, 248, // 00
+    225, 147, 101, 108, 140, 216, 149,  86, 212, 117,  81, 113,  92, 132,  55, 202, // 10
+    233,  73,  99, 116, 251, 115,  52,  42, 195, 109,  71, 177,  58,  80,  87,  50, // 20
+    206, 173,  20, 231,  59,  89,  30,  43, 203, 196,  68, 220, 145, 162,  31,  62, // 30
+    230, 246, 139, 163, 241, 229,  72, 119, 254, 235,  88, 156, 243, 211,  34,  67, // 40
+    191, 100,  28, 142, 199, 186, 127, 164, 193,  37,  53, 151, 218, 187, 135, 159, // 50
+    154,  33,  14, 181, 152,  49, 228,  45, 148,  77,  46, 118, 157,  38,  63,  70, // 60
+    158,  27, 138, 137, 244, 237,  98, 121, 153,  74,  35,  94, 197, 120,  96, 124, // 70
+    210, 183,  61, 249, 234, 242,  39,  44, 174, 250, 129, 252,  83, 239,  26,  32, // 80
+    172,  13,   9,  25,  76,  69,   7,   6,  56,  47,   4,  10,  57,  15,  11,   8, // 90
+    131,  48,  17,  21,  19,  16,   5,   2,  84,  24,  40,  23,  41,   0,   1,  36, // A0
+     93,  22,  18,   3,  29,  12, 128, 182, 194, 185, 189, 112,  64,  54, 165, 155, // B0
+    240, 217, 160, 232, 215, 169, 201, 221, 208, 213, 150, 176, 236, 134, 143, 166, // C0
+    175, 126, 204,  97,  82,  85, 114, 104, 184, 125,  79, 167,  51,  66,  65, 130, // D0
+    179, 103,  91,  90, 111,  60,  78,  95, 247, 222, 133, 226, 205, 136, 102, 122, // E0
+    190, 105, 106, 110,  75, 107, 207, 178, 219, 161, 141, 144, 146, 180, 209, 253, // F0
+};
+
+// Intentionally not defined: reaching it while evaluating a signature fails the compilation
+void InvalidSignature();
+
+constexpr int ParseHexDigit(char Digit)
+{
+    return (Digit >= '0' && Digit <= '9') ? (Digit - '0') :
+        (Digit >= 'A' && Digit <= 'F') ? (Digit - 'A' + 10) :
+        (Digit >= 'a' && Digit <= 'f') ? (Digit - 'a' + 10) : -1;
+}
+
+static const size_t MaxSignatureLength = 32;
+
+// IDA-style signature ("48 8B ?? ?? C3") parsed into bytes and a mask at compile time
+// The capacity is fixed so signatures of any length can be stored in the same (constexpr) table
+struct Signature
+{
+    uint8_t Bytes[MaxSignatureLength] = {};
+    uint8_t Mask[MaxSignatureLength] = {};
+    size_t Length = 0;
+
+    // The two rarest non-wildcard bytes, the scanner compares these before the full pattern
+    size_t First = 0;
+    size_t Last = 0;
+
+    template<size_t N>
+    constexpr Signature(const char (&Str)[N])
+    {
+        for (size_t i = 0; i < N - 1;)
+        {
+            if (Str[i] == ' ')
+            {
+                i++;
+                continue;
+            }
+
+            if (Length == MaxSignatureLength)
+            {
+                InvalidSignature();
+            }
+
+            if (Str[i] == '?')
+            {
+                // Wildcards are either ? or ??
+                i += Str[i + 1] == '?' ? 2 : 1;
+                Length++;
+            }
+            else
+            {
+                auto High = ParseHexDigit(Str[i]);
+                auto Low = ParseHexDigit(Str[i + 1]);
+                if (High < 0 || Low < 0)
+                {
+                    InvalidSignature();
+                }
+
+                Bytes[Length] = uint8_t(High << 4 | Low);
+                Mask[Length] = 0xFF;
+                Length++;
+                i += 2;
+            }
+
+            // Tokens have to be separated by spaces
+            if (i < N - 1 && Str[i] != ' ')
+            {
+                InvalidSignature();
+            }
+        }
+
+        PlanAnchors();
+    }
+
+    constexpr void PlanAnchors()
+    {
+        auto Rarest = Length;
+        auto SecondRarest = Length;
+
+        for (size_t i = 0; i < Length; i++)
+        {
+            if (Mask[i] == 0)
+            {
+                continue;
+            }
+
+            if (Rarest == Length || X64ByteRank[Bytes[i]] < X64ByteRank[Bytes[Rarest]])
+            {
+                SecondRarest = Rarest;
+                Rarest = i;
+            }
+            else if (SecondRarest == Length || X64ByteRank[Bytes[i]] < X64ByteRank[Bytes[SecondRarest]])
+            {
+                SecondRarest = i;
+            }
+        }
+
+        // Signatures need at least one byte that is not a wildcard
+        if (Rarest == Length)
+        {
+            InvalidSignature();
+        }
+
+        First = Rarest;
+        Last = SecondRarest != Length ? SecondRarest : Rarest;
+    }
+};
+
+template<size_t N>
+constexpr Signature MakeSignature(const char (&Str)[N])
+{
+    return Signature(Str);
+}
+
+constexpr PatternScan SignatureScan(const Signature& Sig)
+{
+    return { Sig.Bytes, Sig.Length, Sig.Mask, nullptr, 0, Sig.First, Sig.Last };
+}
+
+// Creates a PatternScan for an IDA-style signature that is compiled (and validated) at compile time
+#define SIGNATURE(Str)                                       \
+    []                                                       \
+    {                                                        \
+        static constexpr auto Sig = MakeSignature(Str);      \
+        return SignatureScan(Sig);                           \
+    }()
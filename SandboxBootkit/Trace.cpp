@@ -0,0 +1,79 @@
+#include "Trace.hpp"
+
+TraceBuffer* gTraceBuffer = nullptr;
+
+static uint64_t GetTscFrequency()
+{
+    int Regs[4] = {};
+    __cpuid(Regs, 0);
+    auto MaxLeaf = Regs[0];
+
+    // TSC/crystal clock ratio and the crystal frequency
+    if (MaxLeaf >= 0x15)
+    {
+        __cpuid(Regs, 0x15);
+        if (Regs[0] != 0 && Regs[1] != 0 && Regs[2] != 0)
+        {
+            return (uint64_t)(uint32_t)Regs[2] * (uint32_t)Regs[1] / (uint32_t)Regs[0];
+        }
+    }
+
+    // Processor base frequency in MHz, matches the TSC on most parts
+    if (MaxLeaf >= 0x16)
+    {
+        __cpuid(Regs, 0x16);
+        if ((Regs[0] & 0xFFFF) != 0)
+        {
+            return (uint64_t)(Regs[0] & 0xFFFF) * 1000000;
+        }
+    }
+
+    return 0;
+}
+
+void SetTraceBuffer(TraceBuffer* Buffer)
+{
+    if (Buffer != nullptr)
+    {
+        memset(Buffer, 0, sizeof(TraceBuffer));
+        Buffer->Magic = TraceMagic;
+        Buffer->Version = TraceVersion;
+        Buffer->RecordCapacity = TraceRecordCapacity;
+        Buffer->RecordSize = sizeof(TraceRecord);
+        Buffer->TscFrequency = GetTscFrequency();
+    }
+
+    gTraceBuffer = Buffer;
+}
+
+#ifndef BOOTKIT_HOST
+static EFI_GUID gBootkitTraceTableGuid = BOOTKIT_TRACE_TABLE_GUID;
+
+EFI_STATUS InitializeTrace()
+{
+    if (gTraceBuffer != nullptr)
+    {
+        return EFI_SUCCESS;
+    }
+
+    // Runtime services data is left alone by the OS loader, the buffer can still be read after boot
+    EFI_PHYSICAL_ADDRESS Address = 0;
+    auto Status = gBS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, EFI_SIZE_TO_PAGES(sizeof(TraceBuffer)), &Address);
+    if (EFI_ERROR(Status))
+    {
+        return Status;
+    }
+
+    auto Buffer = (TraceBuffer*)Address;
+    Status = gBS->InstallConfigurationTable(&gBootkitTraceTableGuid, Buffer);
+    if (EFI_ERROR(Status))
+    {
+        gBS->FreePages(Address, EFI_SIZE_TO_PAGES(sizeof(TraceBuffer)));
+        return Status;
+    }
+
+    SetTraceBuffer(Buffer);
+
+    return EFI_SUCCESS;
+}
+#endif
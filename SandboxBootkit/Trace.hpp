@@ -0,0 +1,115 @@
+#pragma once
+
+#include "Efi.hpp"
+
+// Boot phase timings and counters, published as a configuration table (see TraceDecoder)
+#define BOOTKIT_TRACE_TABLE_GUID                                                   \
+    {                                                                              \
+        0x5B8A3F1E, 0x7C2D, 0x4E91, { 0xA6, 0x3B, 0x1F, 0x0D, 0x9E, 0x52, 0xC4, 0x87 } \
+    }
+
+static const uint32_t TraceMagic = 0x43525442; // 'BTRC'
+static const uint32_t TraceVersion = 2;
+static const size_t TraceRecordCapacity = 256; // Power of two, the oldest records are overwritten
+
+static_assert((TraceRecordCapacity & (TraceRecordCapacity - 1)) == 0, "TraceRecordCapacity has to be a power of two");
+
+enum TraceEvent : uint16_t
+{
+    TraceEfiRelocateImage,
+    TraceFixRelocations,
+    TracePatchSelfIntegrity,
+    TraceOpenProtocolHook,   // Value: pages probed by FindImageBase (0 for cached modules)
+    TraceBlImgLoadPEImageEx, // Value: image size
+    TracePatchNtoskrnl,
+    TraceSignatureScan,      // Index: patch entry, Value: bytes swept (the sweep is shared by the section's entries)
+    TraceBuildXrefIndex,     // Value: bytes decoded
+    TraceApplyPatches,       // Value: patch targets written
+    TraceEventCount,
+};
+
+enum TraceCounter : uint16_t
+{
+    TraceOpenProtocolCalls,
+    TraceBlImgLoadPEImageExCalls,
+    TraceImagesSeen,
+    TraceBytesScanned,
+    TraceFindImageBasePages,
+    TracePatchCacheHits,
+    TraceArenaBytesAllocated, // Transient arena, see Arena.hpp
+    TraceArenaPeakBytes,      // Maximum, not a sum
+    TraceCounterCount,
+};
+
+struct TraceRecord
+{
+    uint64_t Timestamp; // TSC at the start of the event
+    uint64_t Cycles;
+    uint16_t Event;
+    uint16_t Index;
+    uint32_t Value;
+};
+
+struct TraceBuffer
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t RecordCapacity;
+    uint32_t RecordSize;
+    uint64_t TscFrequency; // Zero if CPUID does not report it
+    uint64_t RecordCount;  // Total written, the ring holds the last RecordCapacity of them
+    uint64_t Counters[TraceCounterCount];
+    TraceRecord Records[TraceRecordCapacity];
+};
+
+// Null until InitializeTrace, every trace call is a no-op then (the host build never sets it)
+extern TraceBuffer* gTraceBuffer;
+
+void SetTraceBuffer(TraceBuffer* Buffer);
+
+#ifndef BOOTKIT_HOST
+// Allocates the buffer as runtime services data and installs the configuration table
+EFI_STATUS InitializeTrace();
+#endif
+
+inline uint64_t TraceBegin()
+{
+    return __rdtsc();
+}
+
+inline void TraceWrite(TraceEvent Event, uint64_t Start, uint64_t Cycles, size_t Index = 0, uint64_t Value = 0)
+{
+    auto Buffer = gTraceBuffer;
+    if (Buffer == nullptr)
+    {
+        return;
+    }
+
+    auto& Record = Buffer->Records[Buffer->RecordCount++ & (TraceRecordCapacity - 1)];
+    Record.Timestamp = Start;
+    Record.Cycles = Cycles;
+    Record.Event = Event;
+    Record.Index = (uint16_t)Index;
+    Record.Value = (uint32_t)Value;
+}
+
+inline void TraceEnd(TraceEvent Event, uint64_t Start, size_t Index = 0, uint64_t Value = 0)
+{
+    TraceWrite(Event, Start, __rdtsc() - Start, Index, Value);
+}
+
+inline void TraceCount(TraceCounter Counter, uint64_t Value = 1)
+{
+    if (gTraceBuffer != nullptr)
+    {
+        gTraceBuffer->Counters[Counter] += Value;
+    }
+}
+
+inline void TraceMax(TraceCounter Counter, uint64_t Value)
+{
+    if (gTraceBuffer != nullptr && gTraceBuffer->Counters[Counter] < Value)
+    {
+        gTraceBuffer->Counters[Counter] = Value;
+    }
+}
@@ -0,0 +1,160 @@
+#include "Trampoline.hpp"
+#include "X64Decoder.hpp"
+
+uint8_t* AllocateTrampoline()
+{
+    EFI_PHYSICAL_ADDRESS Address = 0;
+    auto Status = gBS->AllocatePages(AllocateAnyPages, EfiBootServicesCode, EFI_SIZE_TO_PAGES(TrampolineSize), &Address);
+    if (EFI_ERROR(Status))
+    {
+        return nullptr;
+    }
+
+    return (uint8_t*)Address;
+}
+
+static bool FitsInt32(int64_t Value)
+{
+    return Value >= INT32_MIN && Value <= INT32_MAX;
+}
+
+static uint8_t* WriteAbsoluteJump(uint8_t* Code, uint8_t* Target)
+{
+    // jmp [rip+0]; dq Target
+    memcpy(Code, "\xFF\x25\x00\x00\x00\x00", 6);
+    *(uint8_t**)(Code + 6) = Target;
+
+    return Code + 14;
+}
+
+static bool EndsFunction(const X64Instruction& Instruction)
+{
+    if (Instruction.Flow == X64FlowJump)
+    {
+        return true;
+    }
+
+    if (Instruction.Map != 0)
+    {
+        return false;
+    }
+
+    switch (Instruction.Opcode)
+    {
+    case 0xC2: // ret imm16
+    case 0xC3: // ret
+    case 0xCC: // int3 (padding)
+        return true;
+    case 0xFF: // jmp r/m64
+        return Instruction.HasModRm && ((Instruction.ModRm >> 3) & 7) >= 4 && ((Instruction.ModRm >> 3) & 7) <= 5;
+    default:
+        return false;
+    }
+}
+
+bool CreateTrampoline(void* Function, uint8_t* Trampoline, size_t Size)
+{
+    auto Source = (uint8_t*)Function;
+    auto Code = Trampoline;
+    size_t Copied = 0;
+
+    while (Copied < DetourSize)
+    {
+        X64Instruction Instruction;
+        if (!DecodeInstruction(Source + Copied, 15, &Instruction))
+        {
+            return false;
+        }
+
+        auto Address = Source + Copied;
+        auto Length = Instruction.Length;
+
+        // Worst case this instruction (16 bytes) and the jump back (14 bytes)
+        if ((size_t)(Code - Trampoline) + 16 + 14 > Size)
+        {
+            return false;
+        }
+
+        // The detour would overwrite the next function
+        if (EndsFunction(Instruction) && Copied + Length < DetourSize)
+        {
+            return false;
+        }
+
+        if (Instruction.Flow != X64FlowNone)
+        {
+            auto Target = GetRelativeTarget(Address, Instruction);
+
+            // A branch back into the overwritten bytes cannot be relocated
+            if (Target >= Source && Target < Source + DetourSize)
+            {
+                return false;
+            }
+
+            switch (Instruction.Flow)
+            {
+            case X64FlowCall:
+                // call [rip+2]; jmp +8; dq Target
+                memcpy(Code, "\xFF\x15\x02\x00\x00\x00\xEB\x08", 8);
+                *(uint8_t**)(Code + 8) = Target;
+                Code += 16;
+                break;
+
+            case X64FlowJump:
+                Code = WriteAbsoluteJump(Code, Target);
+                break;
+
+            case X64FlowJcc:
+            {
+                // loop/jrcxz have no inverse
+                uint8_t Condition = 0;
+                if (Instruction.Map == 0 && Instruction.Opcode >= 0x70 && Instruction.Opcode <= 0x7F)
+                {
+                    Condition = Instruction.Opcode & 0xF;
+                }
+                else if (Instruction.Map == 1 && Instruction.Opcode >= 0x80 && Instruction.Opcode <= 0x8F)
+                {
+                    Condition = Instruction.Opcode & 0xF;
+                }
+                else
+                {
+                    return false;
+                }
+
+                // Inverted jcc over an absolute jump
+                Code[0] = 0x70 | (Condition ^ 1);
+                Code[1] = 14;
+                Code = WriteAbsoluteJump(Code + 2, Target);
+                break;
+            }
+
+            default:
+                return false;
+            }
+        }
+        else
+        {
+            memcpy(Code, Address, Length);
+
+            if (Instruction.RipRelative)
+            {
+                auto Target = GetRelativeTarget(Address, Instruction);
+                auto Displacement = Target - (Code + Length);
+                if (!FitsInt32(Displacement))
+                {
+                    return false;
+                }
+
+                *(int32_t*)(Code + Instruction.DispOffset) = (int32_t)Displacement;
+            }
+
+            Code += Length;
+        }
+
+        Copied += Length;
+    }
+
+    WriteAbsoluteJump(Code, Source + Copied);
+
+    return true;
+}
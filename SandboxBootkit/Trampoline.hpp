@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Efi.hpp"
+
+// Room for the relocated prologue (a few instructions, branches grow to 16 bytes) and the jump back
+static const size_t TrampolineSize = 128;
+
+// Executable memory for trampolines, has to be allocated while boot services are available
+uint8_t* AllocateTrampoline();
+
+// Copies the instructions the detour overwrites into Trampoline followed by a jump back to the rest of Function
+// RIP-relative operands are adjusted and relative branches become absolute, fails if the prologue cannot be moved
+bool CreateTrampoline(void* Function, uint8_t* Trampoline, size_t Size = TrampolineSize);
+
+// Installs a permanent detour, the original function is called through the returned trampoline
+template<typename Func>
+Func* DetourAttach(Func* Function, Func* HookFunction, uint8_t* Trampoline)
+{
+    if (Trampoline == nullptr || !CreateTrampoline((void*)Function, Trampoline))
+    {
+        return nullptr;
+    }
+
+    uint8_t OriginalBytes[DetourSize];
+    DetourCreate(Function, HookFunction, OriginalBytes);
+
+    return (Func*)Trampoline;
+}
@@ -0,0 +1,323 @@
+#include "X64Decoder.hpp"
+
+// Opcode table flags
+#define OP_MODRM 0x01
+#define OP_IMM8 0x02
+#define OP_IMM16 0x04
+#define OP_IMMZ 0x08 // imm16/imm32 depending on the operand size
+#define OP_REL8 0x10
+#define OP_REL32 0x20
+#define OP_INVALID 0x40
+#define OP_SPECIAL 0x80 // Prefixes, escapes and opcodes with operand-dependent sizes
+
+// One-byte opcode map (64-bit mode)
+static const uint8_t OneByteTable[256] = {
+    0x01, 0x01, 0x01, 0x01, 0x02, 0x08, 0x40, 0x40, 0x01, 0x01, 0x01, 0x01, 0x02, 0x08, 0x40, 0x80, // 00
+    0x01, 0x01, 0x01, 0x01, 0x02, 0x08, 0x40, 0x40, 0x01, 0x01, 0x01, 0x01, 0x02, 0x08, 0x40, 0x40, // 10
+    0x01, 0x01, 0x01, 0x01, 0x02, 0x08, 0x80, 0x40, 0x01, 0x01, 0x01, 0x01, 0x02, 0x08, 0x80, 0x40, // 20
+    0x01, 0x01, 0x01, 0x01, 0x02, 0x08, 0x80, 0x40, 0x01, 0x01, 0x01, 0x01, 0x02, 0x08, 0x80, 0x40, // 30
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, // 40
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 50
+    0x40, 0x40, 0x80, 0x01, 0x80, 0x80, 0x80, 0x80, 0x08, 0x09, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00, // 60
+    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, // 70
+    0x03, 0x09, 0x40, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 80
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, // 90
+    0x80, 0x80, 0x80, 0x80, 0x00, 0x00, 0x00, 0x00, 0x02, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // A0
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, // B0
+    0x03, 0x03, 0x04, 0x00, 0x80, 0x80, 0x03, 0x09, 0x06, 0x00, 0x04, 0x00, 0x00, 0x02, 0x40, 0x00, // C0
+    0x01, 0x01, 0x01, 0x01, 0x40, 0x40, 0x40, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // D0
+    0x10, 0x10, 0x10, 0x10, 0x02, 0x02, 0x02, 0x02, 0x20, 0x20, 0x40, 0x10, 0x00, 0x00, 0x00, 0x00, // E0
+    0x80, 0x00, 0x80, 0x80, 0x00, 0x00, 0x81, 0x81, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, // F0
+};
+
+// Two-byte opcode map (0F xx)
+static const uint8_t TwoByteTable[256] = {
+    0x01, 0x01, 0x01, 0x01, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x40, 0x01, 0x00, 0x03, // 00
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 10
+    0x01, 0x01, 0x01, 0x01, 0x40, 0x40, 0x40, 0x40, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 20
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x80, 0x40, 0x80, 0x40, 0x40, 0x40, 0x40, 0x40, // 30
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 40
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 50
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 60
+    0x03, 0x03, 0x03, 0x03, 0x01, 0x01, 0x01, 0x00, 0x01, 0x01, 0x40, 0x40, 0x01, 0x01, 0x01, 0x01, // 70
+    0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, // 80
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // 90
+    0x00, 0x00, 0x00, 0x01, 0x03, 0x01, 0x40, 0x40, 0x00, 0x00, 0x00, 0x01, 0x03, 0x01, 0x01, 0x01, // A0
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, // B0
+    0x01, 0x01, 0x03, 0x01, 0x03, 0x03, 0x03, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // C0
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // D0
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // E0
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, // F0
+};
+
+static bool IsLegacyPrefix(uint8_t Byte)
+{
+    switch (Byte)
+    {
+    case 0x26: // es
+    case 0x2E: // cs
+    case 0x36: // ss
+    case 0x3E: // ds
+    case 0x64: // fs
+    case 0x65: // gs
+    case 0x66: // operand size
+    case 0x67: // address size
+    case 0xF0: // lock
+    case 0xF2: // repne
+    case 0xF3: // rep
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool DecodeInstruction(const uint8_t* Code, size_t MaxLen, X64Instruction* Instruction)
+{
+    *Instruction = {};
+
+    if (MaxLen > 15)
+    {
+        MaxLen = 15;
+    }
+
+    size_t i = 0;
+    bool OperandSize = false;
+    bool AddressSize = false;
+    uint8_t Rex = 0;
+
+    // Legacy prefixes and REX (a REX prefix is only used when it directly precedes the opcode)
+    for (; i < MaxLen; i++)
+    {
+        auto Byte = Code[i];
+
+        if (IsLegacyPrefix(Byte))
+        {
+            OperandSize |= Byte == 0x66;
+            AddressSize |= Byte == 0x67;
+            Rex = 0;
+        }
+        else if ((Byte & 0xF0) == 0x40)
+        {
+            Rex = Byte;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (i >= MaxLen)
+    {
+        return false;
+    }
+
+    uint8_t Flags = 0;
+    auto Opcode = Code[i++];
+
+    if (Opcode == 0xC4 || Opcode == 0xC5 || Opcode == 0x62)
+    {
+        // VEX (C4: 3 bytes, C5: 2 bytes) or EVEX (4 bytes) prefix, always valid in 64-bit mode
+        auto PrefixLen = Opcode == 0xC5 ? 1 : (Opcode == 0xC4 ? 2 : 3);
+        if (i + PrefixLen >= MaxLen)
+        {
+            return false;
+        }
+
+        Instruction->Map = Opcode == 0xC5 ? 1 : (Code[i] & (Opcode == 0xC4 ? 0x1F : 0x07));
+        i += PrefixLen;
+        Opcode = Code[i++];
+
+        // Everything has a ModR/M byte except vzeroupper/vzeroall
+        Flags = (Instruction->Map == 1 && Opcode == 0x77) ? 0 : OP_MODRM;
+
+        // Instructions from the 0F 3A map and a few 0F ones take an imm8
+        if (Instruction->Map == 3 || (Instruction->Map == 1 && ((Opcode >= 0x70 && Opcode <= 0x73) || (Opcode >= 0xC4 && Opcode <= 0xC6) || Opcode == 0xC2)))
+        {
+            Flags |= OP_IMM8;
+        }
+    }
+    else if (Opcode == 0x0F)
+    {
+        if (i >= MaxLen)
+        {
+            return false;
+        }
+
+        Opcode = Code[i++];
+        Flags = TwoByteTable[Opcode];
+        Instruction->Map = 1;
+
+        if (Flags & OP_SPECIAL)
+        {
+            // Three-byte maps (0F 38 xx and 0F 3A xx imm8)
+            if (i >= MaxLen)
+            {
+                return false;
+            }
+
+            Instruction->Map = Opcode == 0x38 ? 2 : 3;
+            Flags = Opcode == 0x38 ? OP_MODRM : (OP_MODRM | OP_IMM8);
+            Opcode = Code[i++];
+        }
+    }
+    else
+    {
+        Flags = OneByteTable[Opcode];
+    }
+
+    if (Flags & OP_INVALID)
+    {
+        return false;
+    }
+
+    Instruction->Opcode = Opcode;
+
+    // Parse the ModR/M, SIB and displacement
+    if (Flags & OP_MODRM)
+    {
+        if (i >= MaxLen)
+        {
+            return false;
+        }
+
+        auto ModRm = Code[i++];
+        auto Mod = ModRm >> 6;
+
+        // mov to/from control and debug registers ignores the mod field
+        if (Instruction->Map == 1 && Opcode >= 0x20 && Opcode <= 0x23)
+        {
+            Mod = 3;
+        }
+        auto Rm = ModRm & 7;
+
+        Instruction->HasModRm = true;
+        Instruction->ModRm = ModRm;
+
+        if (Mod != 3)
+        {
+            if (Rm == 4)
+            {
+                if (i >= MaxLen)
+                {
+                    return false;
+                }
+
+                // SIB with no base register
+                auto Sib = Code[i++];
+                if (Mod == 0 && (Sib & 7) == 5)
+                {
+                    Instruction->DispSize = 4;
+                }
+            }
+            else if (Mod == 0 && Rm == 5)
+            {
+                Instruction->DispSize = 4;
+                Instruction->RipRelative = true;
+            }
+
+            if (Mod == 1)
+            {
+                Instruction->DispSize = 1;
+            }
+            else if (Mod == 2)
+            {
+                Instruction->DispSize = 4;
+            }
+
+            if (Instruction->DispSize != 0)
+            {
+                Instruction->DispOffset = (uint8_t)i;
+                i += Instruction->DispSize;
+            }
+        }
+    }
+
+    // Determine the immediate size
+    size_t ImmSize = 0;
+
+    if (Flags & OP_IMM8)
+    {
+        ImmSize += 1;
+    }
+
+    if (Flags & OP_IMM16)
+    {
+        ImmSize += 2;
+    }
+
+    if (Flags & OP_IMMZ)
+    {
+        ImmSize += OperandSize ? 2 : 4;
+    }
+
+    if (Flags & OP_REL8)
+    {
+        ImmSize = 1;
+        Instruction->Flow = Opcode == 0xEB ? X64FlowJump : X64FlowJcc;
+    }
+
+    if (Flags & OP_REL32)
+    {
+        ImmSize = 4;
+        Instruction->Flow = Instruction->Map != 0 ? X64FlowJcc : (Opcode == 0xE8 ? X64FlowCall : X64FlowJump);
+    }
+
+    if ((Flags & OP_SPECIAL) && Instruction->Map == 0)
+    {
+        if (Opcode >= 0xA0 && Opcode <= 0xA3)
+        {
+            // mov al/ax/eax/rax, moffs
+            ImmSize = AddressSize ? 4 : 8;
+        }
+        else if (Opcode >= 0xB8 && Opcode <= 0xBF)
+        {
+            // mov r64, imm64
+            ImmSize = (Rex & 0x08) ? 8 : (OperandSize ? 2 : 4);
+        }
+        else if (Opcode == 0xF6 || Opcode == 0xF7)
+        {
+            // Only test r/m, imm has an immediate in group 3
+            if (((Instruction->ModRm >> 3) & 7) < 2)
+            {
+                ImmSize = Opcode == 0xF6 ? 1 : (OperandSize ? 2 : 4);
+            }
+        }
+    }
+
+    if (ImmSize != 0)
+    {
+        Instruction->ImmOffset = (uint8_t)i;
+        Instruction->ImmSize = (uint8_t)ImmSize;
+        i += ImmSize;
+    }
+
+    if (i > MaxLen)
+    {
+        return false;
+    }
+
+    Instruction->Length = (uint8_t)i;
+
+    return true;
+}
+
+uint8_t* GetRelativeTarget(uint8_t* Address, const X64Instruction& Instruction)
+{
+    int64_t Displacement = 0;
+
+    if (Instruction.Flow != X64FlowNone)
+    {
+        auto Imm = Address + Instruction.ImmOffset;
+        Displacement = Instruction.ImmSize == 1 ? *(int8_t*)Imm : *(int32_t*)Imm;
+    }
+    else if (Instruction.RipRelative)
+    {
+        Displacement = *(int32_t*)(Address + Instruction.DispOffset);
+    }
+    else
+    {
+        return nullptr;
+    }
+
+    return Address + Instruction.Length + Displacement;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "Efi.hpp"
+
+enum X64Flow : uint8_t
+{
+    X64FlowNone,
+    X64FlowCall, // call rel32
+    X64FlowJump, // jmp rel8/rel32
+    X64FlowJcc,  // jcc/loop/jrcxz rel8, jcc rel32
+};
+
+struct X64Instruction
+{
+    uint8_t Length;
+    uint8_t Map;    // 0: one-byte, 1: 0F, 2: 0F 38, 3: 0F 3A (VEX/EVEX maps use the same numbering)
+    uint8_t Opcode; // Final opcode byte
+    uint8_t ModRm;  // Only valid if HasModRm
+    bool HasModRm;
+    bool RipRelative;
+    uint8_t DispOffset; // Offset of the displacement in the instruction (0 if none)
+    uint8_t DispSize;
+    uint8_t ImmOffset; // Offset of the immediate (or relative branch displacement) in the instruction
+    uint8_t ImmSize;
+    X64Flow Flow; // Relative branches store their displacement in the immediate
+};
+
+bool DecodeInstruction(const uint8_t* Code, size_t MaxLen, X64Instruction* Instruction);
+uint8_t* GetRelativeTarget(uint8_t* Address, const X64Instruction& Instruction);
@@ -0,0 +1,188 @@
+#include <algorithm>
+
+#include "XrefIndex.hpp"
+#include "X64Decoder.hpp"
+
+static bool GetXrefType(const X64Instruction& Instruction, uint32_t* Type)
+{
+    switch (Instruction.Flow)
+    {
+    case X64FlowCall:
+        *Type = XrefCall;
+        return true;
+    case X64FlowJump:
+        *Type = XrefJump;
+        return true;
+    case X64FlowNone:
+        *Type = XrefData;
+        return Instruction.RipRelative;
+    default:
+        return false;
+    }
+}
+
+// Stable LSD radix sort on the target, the sources stay sorted within a target
+static Xref* SortXrefs(Xref* Entries, Xref* Scratch, size_t Count, uint32_t MaxTarget)
+{
+    const uint32_t RadixBits = 11;
+    const uint32_t RadixSize = 1 << RadixBits;
+    static BOOTKIT_THREAD_LOCAL uint32_t Offsets[RadixSize];
+
+    for (uint32_t Shift = 0; Shift < 32 && (MaxTarget >> Shift) != 0; Shift += RadixBits)
+    {
+        memset(Offsets, 0, sizeof(Offsets));
+
+        for (size_t i = 0; i < Count; i++)
+        {
+            Offsets[(Entries[i].Target >> Shift) & (RadixSize - 1)]++;
+        }
+
+        uint32_t Offset = 0;
+        for (uint32_t i = 0; i < RadixSize; i++)
+        {
+            auto BucketSize = Offsets[i];
+            Offsets[i] = Offset;
+            Offset += BucketSize;
+        }
+
+        for (size_t i = 0; i < Count; i++)
+        {
+            Scratch[Offsets[(Entries[i].Target >> Shift) & (RadixSize - 1)]++] = Entries[i];
+        }
+
+        std::swap(Entries, Scratch);
+    }
+
+    return Entries;
+}
+
+bool BuildXrefIndex(XrefIndex& Index, void* ImageBase, uint8_t* Base, size_t Size, void* Storage, size_t StorageSize)
+{
+    Index = {};
+
+    auto NtHeaders = GetNtHeaders(ImageBase);
+    if (NtHeaders == nullptr || Storage == nullptr)
+    {
+        return false;
+    }
+
+    auto ExceptionDirectory = &NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+    if (ExceptionDirectory->VirtualAddress == 0 || ExceptionDirectory->Size == 0)
+    {
+        return false;
+    }
+
+    auto Capacity = StorageSize / (2 * sizeof(Xref));
+    auto Entries = (Xref*)Storage;
+    size_t Count = 0;
+    uint32_t MaxTarget = 0;
+
+    auto ImageSize = NtHeaders->OptionalHeader.SizeOfImage;
+    auto BeginRva = (uint32_t)(Base - (uint8_t*)ImageBase);
+    auto EndRva = BeginRva + (uint32_t)Size;
+
+    // Linear sweep over every function in the range, .pdata is sorted so the sources are too
+    auto Functions = RVA<RUNTIME_FUNCTION*>(ImageBase, ExceptionDirectory->VirtualAddress);
+    auto FunctionCount = ExceptionDirectory->Size / sizeof(RUNTIME_FUNCTION);
+
+    for (size_t i = 0; i < FunctionCount; i++)
+    {
+        auto Function = &Functions[i];
+        if (Function->BeginAddress < BeginRva || Function->EndAddress > EndRva)
+        {
+            continue;
+        }
+
+        for (auto Rva = Function->BeginAddress; Rva < Function->EndAddress;)
+        {
+            auto Address = RVA<uint8_t*>(ImageBase, Rva);
+
+            // Data embedded in the function (jump tables, padding), resync at the next byte
+            X64Instruction Instruction;
+            if (!DecodeInstruction(Address, Function->EndAddress - Rva, &Instruction))
+            {
+                Rva++;
+                continue;
+            }
+
+            uint32_t Type = 0;
+            if (GetXrefType(Instruction, &Type))
+            {
+                auto Target = (uint64_t)(GetRelativeTarget(Address, Instruction) - (uint8_t*)ImageBase);
+
+                // Ignore references outside of the image
+                if (Target < ImageSize)
+                {
+                    if (Count == Capacity)
+                    {
+                        return false;
+                    }
+
+                    auto& Entry = Entries[Count++];
+                    Entry.Target = (uint32_t)Target;
+                    Entry.Source = Rva;
+                    Entry.Type = Type;
+
+                    MaxTarget = std::max(MaxTarget, (uint32_t)Target);
+                }
+            }
+
+            Rva += Instruction.Length;
+        }
+    }
+
+    auto Sorted = SortXrefs(Entries, Entries + Capacity, Count, MaxTarget);
+    if (Sorted != Entries)
+    {
+        memcpy(Entries, Sorted, Count * sizeof(Xref));
+    }
+
+    Index.ImageBase = ImageBase;
+    Index.Entries = Entries;
+    Index.Count = Count;
+
+    return true;
+}
+
+const Xref* FindReferences(const XrefIndex& Index, void* Target, size_t* Count)
+{
+    auto Rva = (uint32_t)((uint8_t*)Target - (uint8_t*)Index.ImageBase);
+    auto Begin = Index.Entries;
+    auto End = Index.Entries + Index.Count;
+
+    // Do a binary search for the range of entries referencing the target
+    auto First = std::lower_bound(Begin, End, Rva, [](const Xref& Entry, uint32_t Rva)
+        {
+            return Entry.Target < Rva;
+        });
+    auto Last = std::upper_bound(First, End, Rva, [](uint32_t Rva, const Xref& Entry)
+        {
+            return Rva < Entry.Target;
+        });
+
+    *Count = Last - First;
+
+    return First;
+}
+
+size_t FindCallers(const XrefIndex& Index, void* Target, uint8_t** Callers, size_t MaxCallers)
+{
+    size_t Count = 0;
+    auto References = FindReferences(Index, Target, &Count);
+
+    size_t CallerCount = 0;
+    for (size_t i = 0; i < Count; i++)
+    {
+        if (References[i].Type == XrefCall)
+        {
+            if (CallerCount < MaxCallers)
+            {
+                Callers[CallerCount] = RVA<uint8_t*>(Index.ImageBase, References[i].Source);
+            }
+
+            CallerCount++;
+        }
+    }
+
+    return CallerCount;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Efi.hpp"
+
+enum XrefType : uint32_t
+{
+    XrefCall, // call rel32
+    XrefJump, // jmp rel8/rel32 (conditional branches are not indexed)
+    XrefData, // RIP-relative memory operand
+};
+
+struct Xref
+{
+    uint32_t Target; // RVA of the referenced address
+    uint32_t Source : 30; // RVA of the referencing instruction
+    uint32_t Type : 2;
+};
+
+struct XrefIndex
+{
+    void* ImageBase;
+    Xref* Entries; // Sorted by target, then by source
+    size_t Count;
+};
+
+// Storage needs room for two entries per reference (the second half is used for sorting)
+static const size_t XrefStorageSize = 2 * 512 * 1024 * sizeof(Xref);
+
+bool BuildXrefIndex(XrefIndex& Index, void* ImageBase, uint8_t* Base, size_t Size, void* Storage, size_t StorageSize);
+const Xref* FindReferences(const XrefIndex& Index, void* Target, size_t* Count);
+size_t FindCallers(const XrefIndex& Index, void* Target, uint8_t** Callers, size_t MaxCallers);
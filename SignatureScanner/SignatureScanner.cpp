@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MappedFile.hpp"
+
+#include "Efi.hpp"
+#include "PatchBootmgfw.hpp"
+#include "PatchNtoskrnl.hpp"
+
+struct ScanResult
+{
+    std::string Report;
+    size_t Resolved;
+    size_t Count;
+    double Microseconds;
+    bool Valid;
+};
+
+static void Append(std::string& Report, const char* Format, ...)
+{
+    char Line[512];
+    va_list Args;
+    va_start(Args, Format);
+    vsnprintf(Line, sizeof(Line), Format, Args);
+    va_end(Args);
+
+    Report += Line;
+}
+
+static const PatchEntry* GetPatchTable(const std::filesystem::path& Path, size_t* Count, const char** Kind)
+{
+    auto FileName = Path.filename().string();
+    std::transform(FileName.begin(), FileName.end(), FileName.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+
+    if (FileName.find("ntoskrnl") != std::string::npos)
+    {
+        *Count = NtoskrnlPatchCount;
+        *Kind = "ntoskrnl";
+        return NtoskrnlPatches;
+    }
+    if (FileName.find("bootmgfw") != std::string::npos)
+    {
+        *Count = BootmgfwPatchCount;
+        *Kind = "bootmgfw";
+        return BootmgfwPatches;
+    }
+
+    return nullptr;
+}
+
+// Appends the RVA every patch of the entry would be written to, false if one of them can not be resolved
+static bool AppendTargets(std::string& Report, const PeImage& Image, const PatchEntry& Entry, uint8_t** Sites)
+{
+    uint8_t* Targets[MaxPatchSites] = {};
+    auto TargetCount = GetPatchTargets(Image, Entry, Sites, Targets);
+
+    auto AllResolved = TargetCount != 0;
+    Report += " ->";
+    for (size_t i = 0; i < TargetCount; i++)
+    {
+        if (Targets[i] != nullptr)
+        {
+            Append(Report, " +%" PRIx64, (uint64_t)(Targets[i] - Image.Base));
+        }
+        else
+        {
+            Report += " unresolved";
+            AllResolved = false;
+        }
+    }
+
+    return AllResolved;
+}
+
+// FindPatchSites with a result per entry, so every entry is reported instead of stopping at the first failure
+static void ScanImage(const PeImage& Image, const PatchEntry* Entries, size_t Count, ScanResult& Result)
+{
+    uint8_t* Sites[MaxPatchSites] = {};
+    PatchSiteResult Results[MaxPatchEntries] = {};
+    if (Count > MaxPatchEntries || GetPatchSiteCount(Entries, Count) > MaxPatchSites)
+    {
+        Append(Result.Report, "  FAIL  table has more than %zu entries or %zu sites\n", MaxPatchEntries, MaxPatchSites);
+        return;
+    }
+
+    FindPatchSites(Image, Entries, Count, Sites, Results);
+
+    auto EntrySites = Sites;
+    for (size_t i = 0; i < Count; i++)
+    {
+        auto& Entry = Entries[i];
+        auto& Site = Results[i];
+        std::string Line;
+
+        if (Site.Status == PatchSiteMissingSection)
+        {
+            Append(Line, "%-36s missing section %s", Entry.Name, Entry.SectionName != nullptr ? Entry.SectionName : "of the match");
+        }
+        else
+        {
+            Append(Line, "%-36s matches %zu", Entry.Name, Site.MatchCount);
+            if (Entry.ExpectedMatches != 0)
+            {
+                Append(Line, "/%u", Entry.ExpectedMatches);
+            }
+            if (Site.Match != nullptr)
+            {
+                Append(Line, " at +%" PRIx64, (uint64_t)(Site.Match - Image.Base));
+            }
+        }
+
+        if (Site.Status == PatchSiteXrefOverflow)
+        {
+            Line += ", xref index overflow";
+        }
+        else if (Site.Status == PatchSiteCallerCount || (Site.Status == PatchSiteFound && Entry.Action == PatchCallers))
+        {
+            Append(Line, ", callers %zu/%u", Site.CallerCount, Entry.ExpectedCallers);
+        }
+
+        auto Passed = Site.Status == PatchSiteFound && AppendTargets(Line, Image, Entry, EntrySites);
+
+        Result.Resolved += Passed;
+        Append(Result.Report, "  %-4s  ", Passed ? "ok" : "FAIL");
+        Result.Report += Line;
+        Result.Report += '\n';
+
+        EntrySites += GetPatchSiteCount(&Entry, 1);
+    }
+}
+
+static void ScanFile(const std::filesystem::path& Path, ScanResult& Result)
+{
+    const char* Kind = nullptr;
+    auto Entries = GetPatchTable(Path, &Result.Count, &Kind);
+
+    MappedFile File;
+    std::vector<uint8_t> Image;
+    auto SizeOfImage = File.Open(Path) ? GetImageFileSize(File.Data(), File.Size()) : 0;
+    if (SizeOfImage != 0)
+    {
+        Image.resize(SizeOfImage);
+        Result.Valid = MapImageFile(File.Data(), File.Size(), Image.data(), Image.size());
+    }
+
+    if (!Result.Valid)
+    {
+        Append(Result.Report, "%s: not a valid x64 PE file\n", Path.string().c_str());
+        return;
+    }
+
+    auto StartTime = std::chrono::steady_clock::now();
+    ScanImage(PeImage(Image.data(), Image.size()), Entries, Result.Count, Result);
+    Result.Microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - StartTime).count();
+
+    // The report of the entries was appended first, the summary line goes above it
+    char Summary[512];
+    snprintf(Summary, sizeof(Summary), "%s (%s, image %zu bytes): %zu of %zu patches resolved in %.0f us\n",
+        Path.string().c_str(), Kind, Image.size(), Result.Resolved, Result.Count, Result.Microseconds);
+    Result.Report.insert(0, Summary);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        puts("Usage: SignatureScanner <directory or file> [threads]");
+        puts("Checks every patch signature and caller count against each file with ntoskrnl or bootmgfw in its name");
+        return EXIT_FAILURE;
+    }
+
+    auto ThreadCount = argc > 2 ? (size_t)strtoull(argv[2], nullptr, 0) : (size_t)std::thread::hardware_concurrency();
+    ThreadCount = std::max<size_t>(ThreadCount, 1);
+
+    size_t Count = 0;
+    const char* Kind = nullptr;
+    std::error_code Error;
+    std::filesystem::path Path = argv[1];
+    std::vector<std::filesystem::path> Files;
+    if (std::filesystem::is_directory(Path, Error))
+    {
+        for (auto& Entry : std::filesystem::recursive_directory_iterator(Path, Error))
+        {
+            if (Entry.is_regular_file(Error) && GetPatchTable(Entry.path(), &Count, &Kind) != nullptr)
+            {
+                Files.push_back(Entry.path());
+            }
+        }
+
+        std::sort(Files.begin(), Files.end());
+    }
+    else if (GetPatchTable(Path, &Count, &Kind) != nullptr)
+    {
+        Files.push_back(Path);
+    }
+
+    if (Files.empty())
+    {
+        printf("No ntoskrnl or bootmgfw images in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // Workers take the next file from a shared counter, the reports are printed in path order
+    std::vector<ScanResult> Results(Files.size());
+    std::atomic<size_t> NextFile(0);
+    auto Worker = [&]
+    {
+        // The xref storage of the engine is per thread
+        if (!InitializePatchEngine())
+        {
+            return;
+        }
+
+        for (auto i = NextFile++; i < Files.size(); i = NextFile++)
+        {
+            ScanFile(Files[i], Results[i]);
+        }
+
+        ShutdownPatchEngine();
+    };
+
+    ThreadCount = std::min(ThreadCount, Files.size());
+    auto StartTime = std::chrono::steady_clock::now();
+    std::vector<std::thread> Threads;
+    for (size_t i = 1; i < ThreadCount; i++)
+    {
+        Threads.emplace_back(Worker);
+    }
+    Worker();
+    for (auto& Thread : Threads)
+    {
+        Thread.join();
+    }
+    auto Microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - StartTime).count();
+
+    size_t Compatible = 0;
+    for (auto& Result : Results)
+    {
+        fputs(Result.Report.c_str(), stdout);
+        Compatible += Result.Valid && Result.Resolved == Result.Count;
+    }
+
+    printf("\n%zu of %zu builds compatible, scanned in %.0f us (%zu threads)\n", Compatible, Files.size(), Microseconds, ThreadCount);
+
+    return Compatible == Files.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
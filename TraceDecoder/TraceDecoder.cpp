@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "MappedFile.hpp"
+
+#include "Trace.hpp"
+
+static const char* EventNames[] = {
+    "EfiRelocateImage",
+    "FixRelocations",
+    "PatchSelfIntegrity",
+    "OpenProtocolHook",
+    "BlImgLoadPEImageEx",
+    "PatchNtoskrnl",
+    "SignatureScan",
+    "BuildXrefIndex",
+    "ApplyPatches",
+};
+
+static const char* CounterNames[] = {
+    "OpenProtocol calls",
+    "BlImgLoadPEImageEx calls",
+    "Images seen",
+    "Bytes scanned",
+    "FindImageBase pages probed",
+    "Patch cache hits",
+    "Arena bytes allocated",
+    "Arena peak bytes",
+};
+
+static_assert(ARRAY_SIZE(EventNames) == TraceEventCount, "EventNames does not match TraceEvent");
+static_assert(ARRAY_SIZE(CounterNames) == TraceCounterCount, "CounterNames does not match TraceCounter");
+
+// The buffer is page aligned, so only page boundaries of a memory dump have to be checked
+static const TraceBuffer* FindTraceBuffer(const uint8_t* Data, size_t Size)
+{
+    for (size_t Offset = 0; Offset + sizeof(TraceBuffer) <= Size; Offset += EFI_PAGE_SIZE)
+    {
+        auto Buffer = (const TraceBuffer*)(Data + Offset);
+        if (Buffer->Magic == TraceMagic && Buffer->Version == TraceVersion &&
+            Buffer->RecordCapacity == TraceRecordCapacity && Buffer->RecordSize == sizeof(TraceRecord))
+        {
+            return Buffer;
+        }
+    }
+
+    return nullptr;
+}
+
+static void PrintDuration(const TraceBuffer* Buffer, uint64_t Cycles)
+{
+    if (Buffer->TscFrequency != 0)
+    {
+        printf("%12.2f us", (double)Cycles * 1000000.0 / (double)Buffer->TscFrequency);
+    }
+    else
+    {
+        printf("%12" PRIu64 " cy", Cycles);
+    }
+}
+
+static void DecodeTraceBuffer(const TraceBuffer* Buffer)
+{
+    printf("TSC frequency: ");
+    if (Buffer->TscFrequency != 0)
+    {
+        printf("%.2f MHz\n", (double)Buffer->TscFrequency / 1000000.0);
+    }
+    else
+    {
+        puts("unknown (durations in cycles)");
+    }
+
+    puts("\nCounters:");
+    for (size_t i = 0; i < TraceCounterCount; i++)
+    {
+        printf("  %-28s %12" PRIu64 "\n", CounterNames[i], Buffer->Counters[i]);
+    }
+
+    // The ring only holds the newest records
+    auto Count = std::min<uint64_t>(Buffer->RecordCount, TraceRecordCapacity);
+    std::vector<TraceRecord> Records;
+    for (auto i = Buffer->RecordCount - Count; i < Buffer->RecordCount; i++)
+    {
+        Records.push_back(Buffer->Records[i & (TraceRecordCapacity - 1)]);
+    }
+
+    printf("\nEvents (%" PRIu64 " recorded", Buffer->RecordCount);
+    if (Buffer->RecordCount > Count)
+    {
+        printf(", oldest %" PRIu64 " overwritten", Buffer->RecordCount - Count);
+    }
+    puts("):");
+
+    if (Records.empty())
+    {
+        return;
+    }
+
+    // Events are written when they end, sort them by their start so nested events follow their parent
+    std::stable_sort(Records.begin(), Records.end(), [](const TraceRecord& Left, const TraceRecord& Right)
+        {
+            if (Left.Timestamp != Right.Timestamp)
+            {
+                return Left.Timestamp < Right.Timestamp;
+            }
+
+            return Left.Cycles != Right.Cycles ? Left.Cycles > Right.Cycles : Left.Index < Right.Index;
+        });
+
+    auto FirstTimestamp = Records.front().Timestamp;
+    std::vector<const TraceRecord*> Parents;
+
+    for (auto& Record : Records)
+    {
+        // Records of a shared sweep cover the same range and are siblings
+        while (!Parents.empty() && (Parents.back()->Timestamp + Parents.back()->Cycles <= Record.Timestamp ||
+            (Parents.back()->Timestamp == Record.Timestamp && Parents.back()->Cycles == Record.Cycles)))
+        {
+            Parents.pop_back();
+        }
+
+        printf("  +");
+        PrintDuration(Buffer, Record.Timestamp - FirstTimestamp);
+        PrintDuration(Buffer, Record.Cycles);
+        printf("  %*s%s", (int)Parents.size() * 2, "", Record.Event < TraceEventCount ? EventNames[Record.Event] : "Unknown");
+
+        if (Record.Event == TraceSignatureScan)
+        {
+            printf(" #%u", Record.Index);
+        }
+        if (Record.Value != 0)
+        {
+            printf(" (%u)", Record.Value);
+        }
+        puts("");
+
+        Parents.push_back(&Record);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        puts("Usage: TraceDecoder <file>");
+        puts("Decodes the bootkit trace table from a raw copy of it or a physical memory dump");
+        return EXIT_FAILURE;
+    }
+
+    MappedFile File;
+    if (!File.Open(argv[1]))
+    {
+        printf("Failed to open %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    auto Buffer = FindTraceBuffer(File.Data(), File.Size());
+    if (Buffer == nullptr)
+    {
+        puts("No trace buffer found");
+        return EXIT_FAILURE;
+    }
+
+    printf("Trace buffer at offset 0x%zx\n", (size_t)((const uint8_t*)Buffer - File.Data()));
+    DecodeTraceBuffer(Buffer);
+
+    return EXIT_SUCCESS;
+}